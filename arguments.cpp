@@ -0,0 +1,189 @@
+#include "arguments.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+bool imageMagickFormat = false;
+QSize rawSize;
+
+// Reads one rect per line in either of the formats img-sub prints,
+// empty lines and lines starting with # are ignored
+static bool readDamage(const QString &fileName, QVector<QRect> &rects, FILE *err)
+{
+    FILE *f = fileName == "-" ? stdin : fopen(qPrintable(fileName), "r");
+    if (!f) {
+        fprintf(err, "Failed to open %s\n", qPrintable(fileName));
+        return false;
+    }
+    char *line = 0;
+    size_t capacity = 0;
+    ssize_t length;
+    bool ok = true;
+    while (ok && (length = getline(&line, &capacity, f)) > 0) {
+        while (length && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            line[--length] = '\0';
+        if (!length || line[0] == '#')
+            continue;
+        int x, y, w, h, end = -1;
+        if (sscanf(line, "%d,%d+%dx%d%n", &x, &y, &w, &h, &end) != 4 || end != length) {
+            end = -1;
+            if (sscanf(line, "%dx%d+%d+%d%n", &w, &h, &x, &y, &end) != 4 || end != length)
+                end = -1;
+        }
+        if (end == -1 || w < 0 || h < 0) {
+            fprintf(err, "Invalid damage rect (%s) in %s\n", line, qPrintable(fileName));
+            ok = false;
+        } else {
+            rects.push_back(QRect(x, y, w, h));
+        }
+    }
+    free(line);
+    if (f != stdin)
+        fclose(f);
+    return ok;
+}
+
+int parseArgument(const QString &arg, Options &options, FILE *err)
+{
+    if (arg == "-v" || arg == "--verbose") {
+        ++options.verbose;
+    } else if (arg == "--imagemagick") {
+        imageMagickFormat = true;
+    } else if (arg == "--dump-images") {
+        options.dumpImages = true;
+    } else if (arg.startsWith("--format=")) {
+        const QString format = arg.mid(9);
+        if (format == "text") {
+            options.format = TextOutput;
+        } else if (format == "jsonl") {
+            options.format = JsonLinesOutput;
+        } else if (format == "binary") {
+            options.format = BinaryOutput;
+        } else {
+            fprintf(err, "Invalid --format (%s), must be text, jsonl or binary\n", qPrintable(format));
+            return -1;
+        }
+    } else if (arg.startsWith("--dump-format=")) {
+        const QString format = arg.mid(14);
+        if (format == "png") {
+            options.dumpFormat = PngDump;
+        } else if (format == "fast-png") {
+            options.dumpFormat = FastPngDump;
+        } else if (format == "pam") {
+            options.dumpFormat = PamDump;
+        } else {
+            fprintf(err, "Invalid --dump-format (%s), must be png, fast-png or pam\n", qPrintable(format));
+            return -1;
+        }
+    } else if (arg.startsWith("--dump-path=")) {
+        options.dumpPath = arg.mid(12);
+    } else if (arg == "--no-join") {
+        options.nojoin = true;
+    } else if (arg.startsWith("--threshold=")) {
+        bool ok;
+        QString t = arg.mid(12);
+        bool percent = false;
+        if (t.endsWith("%")) {
+            t.chop(1);
+            percent = true;
+        }
+        options.threshold = t.toFloat(&ok);
+        if (!ok || options.threshold < .0) {
+            fprintf(err, "Invalid threshold (%s), must be positive float value\n",
+                    qPrintable(arg.mid(12)));
+            return -1;
+        }
+        if (percent) {
+            options.threshold /= 100;
+            options.threshold *= 256;
+        }
+        if (options.verbose)
+            qDebug() << "threshold:" << options.threshold;
+    } else if (arg.startsWith("--min-size=")) {
+        bool ok;
+        QString t = arg.mid(11);
+        options.minSize = t.toInt(&ok);
+        if (!ok || options.minSize <= 0) {
+            fprintf(err, "Invalid --min-size (%s), must be positive integer value\n",
+                    qPrintable(arg.mid(12)));
+            return -1;
+        }
+        if (options.verbose)
+            qDebug() << "min-size:" << options.minSize;
+    } else if (arg.startsWith("--raw-size=")) {
+        const QStringList size = arg.mid(11).split("x");
+        bool ok = size.size() == 2;
+        if (ok) {
+            bool heightOk;
+            rawSize = QSize(size.at(0).toInt(&ok), size.at(1).toInt(&heightOk));
+            ok = ok && heightOk;
+        }
+        if (!ok || rawSize.isEmpty()) {
+            fprintf(err, "Invalid --raw-size (%s), must be [width]x[height]\n",
+                    qPrintable(arg.mid(11)));
+            return -1;
+        }
+    } else if (arg.startsWith("--mode=")) {
+        const QString m = arg.mid(7);
+        if (m == "grid") {
+            options.mode = GridMode;
+        } else if (m == "hash") {
+            options.mode = HashMode;
+        } else if (m == "quadtree") {
+            options.mode = QuadtreeMode;
+        } else {
+            fprintf(err, "Invalid --mode (%s), must be grid, hash or quadtree\n", qPrintable(m));
+            return -1;
+        }
+    } else if (arg.startsWith("--jobs=")) {
+        bool ok;
+        options.jobs = arg.mid(7).toInt(&ok);
+        if (!ok || options.jobs <= 0) {
+            fprintf(err, "Invalid --jobs (%s), must be positive integer value\n",
+                    qPrintable(arg.mid(7)));
+            return -1;
+        }
+    } else if (arg == "--stats" || arg == "--stats=text") {
+        options.stats = TextStats;
+    } else if (arg == "--stats=json") {
+        options.stats = JsonStats;
+    } else if (arg.startsWith("--stats=")) {
+        fprintf(err, "Invalid --stats (%s), must be text or json\n", qPrintable(arg.mid(8)));
+        return -1;
+    } else if (arg.startsWith("--stats-file=")) {
+        options.statsFile = arg.mid(13);
+    } else if (arg.startsWith("--band-height=")) {
+        bool ok;
+        options.bandHeight = arg.mid(14).toInt(&ok);
+        if (!ok || options.bandHeight <= 0) {
+            fprintf(err, "Invalid --band-height (%s), must be positive integer value\n",
+                    qPrintable(arg.mid(14)));
+            return -1;
+        }
+    } else if (arg == "--scroll") {
+        options.scroll = true;
+    } else if (arg.startsWith("--damage=")) {
+        options.damage.clear();
+        options.hasDamage = true;
+        if (!readDamage(arg.mid(9), options.damage, err))
+            return -1;
+    } else if (arg.startsWith("--cache-dir=")) {
+        options.cacheDir = arg.mid(12);
+    } else if (arg == "--same") {
+        options.same = true;
+    } else if (arg.startsWith("--range=")) {
+        bool ok;
+        QString t = arg.mid(8);
+        options.range = t.toInt(&ok);
+        options.hasRange = true;
+        if (!ok || options.range <= 0) {
+            fprintf(err, "Invalid --range (%s), must be positive integer value\n",
+                    qPrintable(t));
+            return -1;
+        }
+        if (options.verbose)
+            qDebug() << "range:" << options.range;
+    } else {
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,16 @@
+#ifndef ARGUMENTS_H
+#define ARGUMENTS_H
+
+#include "img-sub.h"
+
+// Settings for decoding and printing that aren't part of Options, shared
+// by img-sub and img-sub-bench
+extern bool imageMagickFormat;
+extern QSize rawSize;
+
+// Applies arg to options (or to the settings above). Returns 1 if arg was
+// an option, 0 if it wasn't and -1 if it was invalid, in which case an
+// error has been written to err.
+int parseArgument(const QString &arg, Options &options, FILE *err);
+
+#endif
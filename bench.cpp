@@ -0,0 +1,520 @@
+#include "arguments.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Generates deterministic pairs of images where the ground truth is known,
+// runs them through the same stages as img-sub and reports the time spent
+// in each along with whether the matches agree with how the pairs were made.
+
+// Every pixel of the new image is expected to come from an offset in the
+// old image (an index into Pair::offsets), to be new content or, for
+// transparent pixels, to match any other transparent pixel
+enum {
+    Fresh = -1,
+    AnyTransparent = -2
+};
+
+struct Pair
+{
+    QImage oldImage, newImage;
+    QVector<QPoint> offsets;
+    QVector<qint16> expected;
+    float threshold;
+};
+
+// xorshift64*, the same seed always gives the same images
+class Random
+{
+public:
+    Random(quint64 seed)
+        : mState(seed ? seed : 1)
+    {}
+
+    quint64 next()
+    {
+        mState ^= mState >> 12;
+        mState ^= mState << 25;
+        mState ^= mState >> 27;
+        return mState * 0x2545f4914f6cdd1dull;
+    }
+    int bounded(int max) { return max > 0 ? int(next() % quint64(max)) : 0; }
+private:
+    quint64 mState;
+};
+
+static void fill(QImage &image, const QRect &rect, Random &random)
+{
+    for (int y=rect.top(); y<=rect.bottom(); ++y) {
+        QRgb *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x=rect.left(); x<=rect.right(); ++x)
+            line[x] = quint32(random.next() >> 16) | 0xff000000;
+    }
+}
+
+static void copy(const QImage &from, const QRect &rect, QImage &to, const QPoint &pos)
+{
+    for (int y=0; y<rect.height(); ++y) {
+        const QRgb *src = reinterpret_cast<const QRgb *>(from.constScanLine(rect.y() + y)) + rect.x();
+        QRgb *dst = reinterpret_cast<QRgb *>(to.scanLine(pos.y() + y)) + pos.x();
+        memcpy(dst, src, rect.width() * sizeof(QRgb));
+    }
+}
+
+static void expect(Pair &pair, const QRect &rect, int value)
+{
+    const int width = pair.newImage.width();
+    for (int y=rect.top(); y<=rect.bottom(); ++y) {
+        qint16 *line = pair.expected.data() + (y * width);
+        for (int x=rect.left(); x<=rect.right(); ++x)
+            line[x] = value;
+    }
+}
+
+static QRect randomRect(const QSize &size, int minSide, int maxSide, Random &random)
+{
+    const int w = qMin(size.width(), minSide + random.bounded(maxSide - minSide));
+    const int h = qMin(size.height(), minSide + random.bounded(maxSide - minSide));
+    return QRect(random.bounded(size.width() - w), random.bounded(size.height() - h), w, h);
+}
+
+// Moves count blocks to places that don't overlap each other, the block
+// contents come from the old image
+static void moveBlocks(Pair &pair, int count, int minSize, Random &random)
+{
+    const QSize size = pair.oldImage.size();
+    const int minSide = qMax(minSize * 2, qMin(size.width(), size.height()) / 16);
+    const int maxSide = qMax(minSide + 1, qMin(size.width(), size.height()) / 4);
+    QVector<QRect> placed;
+    for (int i=0; i<count; ++i) {
+        for (int attempt=0; attempt<100; ++attempt) {
+            const QRect from = randomRect(size, minSide, maxSide, random);
+            const QRect to(QPoint(random.bounded(size.width() - from.width()),
+                                  random.bounded(size.height() - from.height())), from.size());
+            bool overlaps = false;
+            for (const QRect &rect : placed)
+                overlaps = overlaps || rect.intersects(to);
+            if (overlaps || from == to)
+                continue;
+            placed.push_back(to);
+            copy(pair.oldImage, from, pair.newImage, to.topLeft());
+            pair.offsets.push_back(from.topLeft() - to.topLeft());
+            expect(pair, to, pair.offsets.size() - 1);
+            break;
+        }
+    }
+}
+
+static void addFresh(Pair &pair, int count, int minSize, Random &random)
+{
+    const QSize size = pair.oldImage.size();
+    const int side = qMax(minSize, qMin(size.width(), size.height()) / 10);
+    for (int i=0; i<count; ++i) {
+        const QRect rect = randomRect(size, side / 2, side, random);
+        fill(pair.newImage, rect, random);
+        expect(pair, rect, Fresh);
+    }
+}
+
+static void makeTransparent(QImage &image, const QRect &rect)
+{
+    for (int y=rect.top(); y<=rect.bottom(); ++y) {
+        QRgb *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x=rect.left(); x<=rect.right(); ++x)
+            line[x] = 0;
+    }
+}
+
+static const char *const scenarios[] = { "blocks", "scroll", "transparent", "noise", 0 };
+
+static bool generate(const QString &scenario, const QSize &size, quint64 seed, int minSize, Pair &pair)
+{
+    Random random(seed);
+    pair.oldImage = QImage(size.width(), size.height(), QImage::Format_ARGB32);
+    fill(pair.oldImage, pair.oldImage.rect(), random);
+    pair.newImage = pair.oldImage.copy();
+    pair.offsets.clear();
+    pair.offsets.push_back(QPoint());
+    pair.expected.fill(0, size.width() * size.height());
+    pair.threshold = 0;
+
+    if (scenario == "blocks") {
+        moveBlocks(pair, 8, minSize, random);
+        addFresh(pair, 4, minSize, random);
+    } else if (scenario == "scroll") {
+        // a page that scrolled down by a bit over 10% of its height
+        const int dy = (size.height() / 10) + 3;
+        copy(pair.oldImage, QRect(0, dy, size.width(), size.height() - dy), pair.newImage, QPoint());
+        pair.offsets.push_back(QPoint(0, dy));
+        expect(pair, QRect(0, 0, size.width(), size.height() - dy), 1);
+        fill(pair.newImage, QRect(0, size.height() - dy, size.width(), dy), random);
+        expect(pair, QRect(0, size.height() - dy, size.width(), dy), Fresh);
+    } else if (scenario == "transparent") {
+        for (int i=0; i<4; ++i) {
+            const QRect rect = randomRect(size, size.width() / 8, size.width() / 3, random);
+            makeTransparent(pair.oldImage, rect);
+        }
+        pair.newImage = pair.oldImage.copy();
+        moveBlocks(pair, 6, minSize, random);
+        const int width = size.width();
+        for (int y=0; y<size.height(); ++y) {
+            const QRgb *line = reinterpret_cast<const QRgb *>(pair.newImage.constScanLine(y));
+            for (int x=0; x<width; ++x) {
+                if (!qAlpha(line[x]))
+                    pair.expected[(y * width) + x] = AnyTransparent;
+            }
+        }
+    } else if (scenario == "noise") {
+        // moved blocks under noise that a threshold of 4 still matches
+        moveBlocks(pair, 8, minSize, random);
+        addFresh(pair, 4, minSize, random);
+        for (int y=0; y<size.height(); ++y) {
+            QRgb *line = reinterpret_cast<QRgb *>(pair.newImage.scanLine(y));
+            for (int x=0; x<size.width(); ++x) {
+                const int d = random.bounded(5) - 2;
+                line[x] = qRgba(qBound(0, qRed(line[x]) + d, 255), qGreen(line[x]),
+                                qBound(0, qBlue(line[x]) - d, 255), qAlpha(line[x]));
+            }
+        }
+        pair.threshold = 4;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Raw BGRA is what QImage::Format_ARGB32 looks like in memory on little
+// endian machines so it's loaded without conversion
+static bool writeRaw(const QImage &image, const QString &fileName)
+{
+    FILE *f = fopen(fileName.toLocal8Bit().constData(), "w");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s for writing\n", qPrintable(fileName));
+        return false;
+    }
+    bool ok = true;
+    for (int y=0; y<image.height() && ok; ++y) {
+        const uchar *line = image.constScanLine(y);
+        ok = fwrite(line, image.width() * 4, 1, f) == 1;
+    }
+    fclose(f);
+    if (!ok)
+        fprintf(stderr, "Failed to write %s\n", qPrintable(fileName));
+    return ok;
+}
+
+// How the pairs are stored before they're loaded, raw is mapped and png
+// goes through the decoder
+enum Storage {
+    RawStorage,
+    PngStorage
+};
+
+static bool store(const QImage &image, Storage storage, const QString &fileName)
+{
+    if (storage == RawStorage)
+        return writeRaw(image, fileName);
+    if (!image.save(fileName, "PNG")) {
+        fprintf(stderr, "Failed to write %s\n", qPrintable(fileName));
+        return false;
+    }
+    return true;
+}
+
+enum Stage {
+    LoadStage,
+    SearchStage,
+    JoinStage,
+    UncoveredStage,
+    StageCount
+};
+
+static const char *const stageNames[] = { "load", "search", "join", "uncovered" };
+
+struct Measurement
+{
+    qint64 nsecs[StageCount];
+    int matches, changed;
+    qint64 matched, expectedMatched;
+    int wrong;
+    // blocks are the moved areas, Pair::offsets past the unmoved one
+    int blocks, missed;
+    double worstBlock;
+};
+
+// Whether the search is sure to find some of each block. Only --mode=hash
+// looks at every offset, it finds a block if one of the cells of the finest
+// grid is all inside it. Bands and damage limit where it looks.
+static QVector<bool> findableBlocks(const Pair &pair, const Options &options)
+{
+    QVector<bool> findable(pair.offsets.size(), false);
+    if (options.mode != HashMode || options.bandHeight || options.hasDamage)
+        return findable;
+    const int width = pair.newImage.width();
+    const int height = pair.newImage.height();
+    const int count = qMin(width, height) / options.minSize;
+    if (count < 2)
+        return findable;
+    // the same cells as Image::chunks() at that count
+    const int w = width / count;
+    const int h = height / count;
+    for (int y=0; y<count; ++y) {
+        for (int x=0; x<count; ++x) {
+            const QRect cell(x * w, y * h, x + 1 == count ? width - (x * w) : w,
+                             y + 1 == count ? height - (y * h) : h);
+            const qint16 value = pair.expected.at((cell.y() * width) + cell.x());
+            if (value <= 0 || findable.at(value))
+                continue;
+            bool inside = true;
+            for (int yy=cell.top(); inside && yy<=cell.bottom(); ++yy) {
+                const qint16 *line = pair.expected.constData() + (yy * width);
+                for (int xx=cell.left(); inside && xx<=cell.right(); ++xx)
+                    inside = line[xx] == value;
+            }
+            findable[value] = inside;
+        }
+    }
+    return findable;
+}
+
+// Every matched pixel has to come from the offset it was generated with,
+// or from any transparent pixel if it's transparent. Each block has to be
+// found in part if the mode is sure to find it.
+static void check(const Pair &pair, const Options &options, const QVector<std::pair<Chunk, Chunk> > &matches,
+                  Measurement &result)
+{
+    const int width = pair.newImage.width();
+    result.matched = result.expectedMatched = 0;
+    result.wrong = 0;
+    QVector<qint64> blockPixels(pair.offsets.size(), 0), blockFound(pair.offsets.size(), 0);
+    for (qint16 value : pair.expected) {
+        if (value != Fresh)
+            ++result.expectedMatched;
+        if (value >= 0)
+            ++blockPixels[value];
+    }
+    for (const auto &match : matches) {
+        const QRect rect = match.first.rect();
+        const QPoint offset = match.second.rect().topLeft() - rect.topLeft();
+        bool wrong = false;
+        for (int y=rect.top(); y<=rect.bottom(); ++y) {
+            const qint16 *line = pair.expected.constData() + (y * width);
+            for (int x=rect.left(); x<=rect.right(); ++x) {
+                const qint16 value = line[x];
+                if (value == Fresh || (value != AnyTransparent && pair.offsets.at(value) != offset)) {
+                    wrong = true;
+                } else if (value >= 0) {
+                    ++blockFound[value];
+                }
+            }
+        }
+        result.matched += quint64(rect.width()) * rect.height();
+        if (wrong) {
+            ++result.wrong;
+            if (options.verbose) {
+                fprintf(stderr, "Wrong match %d,%d+%dx%d from %d,%d\n", rect.x(), rect.y(),
+                        rect.width(), rect.height(), match.second.rect().x(), match.second.rect().y());
+            }
+        }
+    }
+
+    const QVector<bool> findable = findableBlocks(pair, options);
+    result.blocks = result.missed = 0;
+    result.worstBlock = 1;
+    for (int i=1; i<pair.offsets.size(); ++i) {
+        if (!blockPixels.at(i))
+            continue;
+        ++result.blocks;
+        const double recall = double(blockFound.at(i)) / blockPixels.at(i);
+        result.worstBlock = qMin(result.worstBlock, recall);
+        if (findable.at(i) && !blockFound.at(i))
+            ++result.missed;
+        if (options.verbose) {
+            fprintf(stderr, "Block %d moved by %d,%d found %.1f%%%s\n", i, pair.offsets.at(i).x(),
+                    pair.offsets.at(i).y(), recall * 100., findable.at(i) && !blockFound.at(i) ? " MISSED" : "");
+        }
+    }
+}
+
+static bool run(const Pair &pair, const Options &options, ThreadPool &pool, const QString &dir, Storage storage,
+                Measurement &result)
+{
+    const QString suffix = storage == PngStorage ? ".png" : ".bgra";
+    const QString oldFile = dir + "/img-sub-bench-old" + suffix;
+    const QString newFile = dir + "/img-sub-bench-new" + suffix;
+    if (!store(pair.oldImage, storage, oldFile) || !store(pair.newImage, storage, newFile))
+        return false;
+
+    Options pairOptions = options;
+    if (pair.threshold)
+        pairOptions.threshold = pair.threshold;
+    QElapsedTimer timer;
+    timer.start();
+    std::shared_ptr<Image> oldImage = Image::load(oldFile, pair.oldImage.size());
+    std::shared_ptr<Image> newImage = Image::load(newFile, pair.newImage.size());
+    result.nsecs[LoadStage] = timer.nsecsElapsed();
+    unlink(oldFile.toLocal8Bit().constData());
+    unlink(newFile.toLocal8Bit().constData());
+    if (!oldImage || !newImage) {
+        fprintf(stderr, "Failed to load generated images\n");
+        return false;
+    }
+
+    QVector<std::pair<Chunk, Chunk> > matches;
+    Occupancy used(newImage->size());
+    timer.restart();
+    search(oldImage, newImage, pairOptions, pool, used, matches);
+    result.nsecs[SearchStage] = timer.nsecsElapsed();
+    timer.restart();
+    if (!options.nojoin)
+        joinChunks(matches, options.verbose);
+    result.nsecs[JoinStage] = timer.nsecsElapsed();
+    timer.restart();
+    result.changed = used.uncovered().size();
+    result.nsecs[UncoveredStage] = timer.nsecsElapsed();
+    result.matches = matches.size();
+
+    check(pair, pairOptions, matches, result);
+    return true;
+}
+
+static void printUsage(FILE *f)
+{
+    fprintf(f,
+            "img-sub-bench [options...]\n"
+            "  --sizes=[width]x[height],...       Image sizes (640x480,1920x1080,3840x2160,7680x4320)\n"
+            "  --scenarios=[scenario],...         blocks, scroll, transparent and/or noise (all)\n"
+            "  --iterations=[count]               Runs per pair, the fastest is reported (3)\n"
+            "  --seed=[seed]                      Seed for the generated images (1)\n"
+            "  --tmp=[dir]                        Where generated images are written (/tmp)\n"
+            "  --store=[bgra|png]                 Write the images as raw pixels that are mapped or\n"
+            "                                     as png so load includes decoding them (bgra)\n"
+            "\n"
+            "img-sub options like --mode, --jobs, --range, --min-size and --threshold apply\n"
+            "as well. Exits with 1 if any match disagrees with how the images were made, or\n"
+            "if --mode=hash misses a moved block that one of its cells fits in.\n");
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    QList<QSize> sizes;
+    sizes << QSize(640, 480) << QSize(1920, 1080) << QSize(3840, 2160) << QSize(7680, 4320);
+    QStringList scenarioNames;
+    for (int i=0; scenarios[i]; ++i)
+        scenarioNames.append(scenarios[i]);
+    int iterations = 3;
+    quint64 seed = 1;
+    QString dir = "/tmp";
+    Storage storage = RawStorage;
+    for (int i=1; i<argc; ++i) {
+        const QString arg = QString::fromLocal8Bit(argv[i]);
+        if (arg == "--help" || arg == "-h") {
+            printUsage(stdout);
+            return 0;
+        } else if (arg.startsWith("--sizes=")) {
+            sizes.clear();
+            for (const QString &size : arg.mid(8).split(",")) {
+                const QStringList dimensions = size.split("x");
+                bool ok = dimensions.size() == 2, heightOk = false;
+                if (ok)
+                    sizes.append(QSize(dimensions.at(0).toInt(&ok), dimensions.at(1).toInt(&heightOk)));
+                if (!ok || !heightOk || sizes.last().isEmpty()) {
+                    fprintf(stderr, "Invalid --sizes (%s), must be [width]x[height],...\n",
+                            qPrintable(arg.mid(8)));
+                    return 1;
+                }
+            }
+        } else if (arg.startsWith("--scenarios=")) {
+            scenarioNames = arg.mid(12).split(",");
+        } else if (arg.startsWith("--iterations=")) {
+            bool ok;
+            iterations = arg.mid(13).toInt(&ok);
+            if (!ok || iterations <= 0) {
+                fprintf(stderr, "Invalid --iterations (%s), must be positive integer value\n",
+                        qPrintable(arg.mid(13)));
+                return 1;
+            }
+        } else if (arg.startsWith("--seed=")) {
+            bool ok;
+            seed = arg.mid(7).toULongLong(&ok);
+            if (!ok) {
+                fprintf(stderr, "Invalid --seed (%s), must be integer value\n", qPrintable(arg.mid(7)));
+                return 1;
+            }
+        } else if (arg.startsWith("--tmp=")) {
+            dir = arg.mid(6);
+        } else if (arg.startsWith("--store=")) {
+            const QString format = arg.mid(8);
+            if (format == "bgra") {
+                storage = RawStorage;
+            } else if (format == "png") {
+                storage = PngStorage;
+            } else {
+                fprintf(stderr, "Invalid --store (%s), must be bgra or png\n", qPrintable(format));
+                return 1;
+            }
+        } else {
+            const int parsed = parseArgument(arg, options, stderr);
+            if (parsed < 0)
+                return 1;
+            if (!parsed) {
+                printUsage(stderr);
+                fprintf(stderr, "Unknown argument %s\n", qPrintable(arg));
+                return 1;
+            }
+        }
+    }
+
+    ThreadPool pool(options.jobs);
+    int failures = 0;
+    for (const QSize &size : sizes) {
+        for (const QString &scenario : scenarioNames) {
+            Pair pair;
+            if (!generate(scenario, size, seed, options.minSize, pair)) {
+                fprintf(stderr, "Unknown scenario %s\n", qPrintable(scenario));
+                return 1;
+            }
+            if (options.mode == HashMode && (pair.threshold || options.threshold)) {
+                printf("%5dx%-5d %-12s skipped, --mode=hash can't use a threshold\n",
+                       size.width(), size.height(), qPrintable(scenario));
+                continue;
+            }
+            Measurement best;
+            if (!run(pair, options, pool, dir, storage, best))
+                return 1;
+            for (int i=1; i<iterations; ++i) {
+                Measurement result;
+                if (!run(pair, options, pool, dir, storage, result))
+                    return 1;
+                for (int stage=0; stage<StageCount; ++stage)
+                    best.nsecs[stage] = qMin(best.nsecs[stage], result.nsecs[stage]);
+            }
+
+            const double pixels = double(size.width()) * size.height();
+            qint64 total = 0;
+            printf("%5dx%-5d %-12s", size.width(), size.height(), qPrintable(scenario));
+            for (int stage=0; stage<StageCount; ++stage) {
+                total += best.nsecs[stage];
+                printf(" %s %.2fms", stageNames[stage], best.nsecs[stage] / 1000000.);
+            }
+            printf(" total %.2fms %.1fMpx/s matches %d changed %d found %.1f%% worst block %.1f%% %s\n",
+                   total / 1000000., pixels * 1000. / qMax<qint64>(total, 1),
+                   best.matches, best.changed, best.expectedMatched ? (best.matched * 100. / best.expectedMatched) : 100.,
+                   best.blocks ? best.worstBlock * 100. : 100., best.wrong ? "WRONG" : best.missed ? "MISSED" : "ok");
+            if (best.wrong) {
+                fprintf(stderr, "%d matches in %dx%d %s disagree with the ground truth\n",
+                        best.wrong, size.width(), size.height(), qPrintable(scenario));
+                ++failures;
+            }
+            if (best.missed) {
+                fprintf(stderr, "%d of %d moved blocks in %dx%d %s weren't found\n",
+                        best.missed, best.blocks, size.width(), size.height(), qPrintable(scenario));
+                ++failures;
+            }
+            fflush(stdout);
+        }
+    }
+    return failures ? 1 : 0;
+}
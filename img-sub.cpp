@@ -0,0 +1,1762 @@
+#include "img-sub.h"
+#include <set>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define IMG_SUB_X86
+#endif
+
+Thresholds::Thresholds(float threshold)
+{
+    const double s = double(threshold) * threshold;
+    squared = s >= 3 * 255 * 255 ? 3 * 255 * 255 : int(s);
+    alpha = threshold >= 255 ? 255 : int(threshold);
+}
+
+// Pixels are packed 32-bit ARGB values (QRgb). Two pixels match when the
+// distance between their rgb values and the distance between their alpha
+// values are both <= threshold.
+static inline bool comparePixel(quint32 a, quint32 b, const Thresholds &t)
+{
+    const int db = int(a & 0xff) - int(b & 0xff);
+    const int dg = int((a >> 8) & 0xff) - int((b >> 8) & 0xff);
+    const int dr = int((a >> 16) & 0xff) - int((b >> 16) & 0xff);
+    const int da = int(a >> 24) - int(b >> 24);
+    return (dr * dr) + (dg * dg) + (db * db) <= t.squared && abs(da) <= t.alpha;
+}
+
+static bool comparePixelsScalar(const quint32 *a, const quint32 *b, int count, const Thresholds &t)
+{
+    for (int i=0; i<count; ++i) {
+        if (!comparePixel(a[i], b[i], t))
+            return false;
+    }
+    return true;
+}
+
+#ifdef IMG_SUB_X86
+static bool comparePixelsSSE2(const quint32 *a, const quint32 *b, int count, const Thresholds &t)
+{
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i maxSquared = _mm_set1_epi32(t.squared);
+    const __m128i maxAlpha = _mm_set1_epi32(t.alpha);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        const __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        // each channel is now a 32-bit lane with the high half zero, madd_epi16 squares it
+        const __m128i db = _mm_and_si128(d, mask);
+        const __m128i dg = _mm_and_si128(_mm_srli_epi32(d, 8), mask);
+        const __m128i dr = _mm_and_si128(_mm_srli_epi32(d, 16), mask);
+        const __m128i da = _mm_srli_epi32(d, 24);
+        const __m128i squared = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(db, db), _mm_madd_epi16(dg, dg)),
+                                              _mm_madd_epi16(dr, dr));
+        const __m128i mismatch = _mm_or_si128(_mm_cmpgt_epi32(squared, maxSquared), _mm_cmpgt_epi32(da, maxAlpha));
+        if (_mm_movemask_epi8(mismatch))
+            return false;
+    }
+    return comparePixelsScalar(a + i, b + i, count - i, t);
+}
+
+__attribute__((target("avx2")))
+static bool comparePixelsAVX2(const quint32 *a, const quint32 *b, int count, const Thresholds &t)
+{
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m256i maxSquared = _mm256_set1_epi32(t.squared);
+    const __m256i maxAlpha = _mm256_set1_epi32(t.alpha);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+        const __m256i d = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+        const __m256i db = _mm256_and_si256(d, mask);
+        const __m256i dg = _mm256_and_si256(_mm256_srli_epi32(d, 8), mask);
+        const __m256i dr = _mm256_and_si256(_mm256_srli_epi32(d, 16), mask);
+        const __m256i da = _mm256_srli_epi32(d, 24);
+        const __m256i squared = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(db, db), _mm256_madd_epi16(dg, dg)),
+                                                 _mm256_madd_epi16(dr, dr));
+        const __m256i mismatch = _mm256_or_si256(_mm256_cmpgt_epi32(squared, maxSquared),
+                                                 _mm256_cmpgt_epi32(da, maxAlpha));
+        if (_mm256_movemask_epi8(mismatch))
+            return false;
+    }
+    return comparePixelsSSE2(a + i, b + i, count - i, t);
+}
+#endif
+
+typedef bool (*ComparePixelsFunction)(const quint32 *, const quint32 *, int, const Thresholds &);
+static ComparePixelsFunction selectComparePixels()
+{
+#ifdef IMG_SUB_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return comparePixelsAVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return comparePixelsSSE2;
+#endif
+    return comparePixelsScalar;
+}
+
+static const ComparePixelsFunction comparePixelsImpl = selectComparePixels();
+
+// Compares count consecutive pixels, returns false on the first mismatch
+static inline bool comparePixels(const quint32 *a, const quint32 *b, int count, const Thresholds &t)
+{
+    if (t.isExact())
+        return !memcmp(a, b, count * sizeof(quint32));
+    return comparePixelsImpl(a, b, count, t);
+}
+
+bool Color::compare(const Color &other, const Thresholds &thresholds) const
+{
+    return comparePixel(rgba(), other.rgba(), thresholds);
+}
+
+// Returns false if no pixel-by-pixel comparison of two rects of count pixels
+// with these sums can succeed with threshold t. The mean rgb of
+// two matching rects can't differ by more than threshold, and neither can
+// the rms of their pixels' distances to that mean (with alpha included).
+static bool sumsMayMatch(const Sums &a, const Sums &b, quint64 count, const Thresholds &t)
+{
+    if (t.isExact()) {
+        return (a.red == b.red && a.green == b.green && a.blue == b.blue
+                && a.alpha == b.alpha && a.squares == b.squares);
+    }
+    const double n = count;
+    const double dr = double(a.red) - b.red;
+    const double dg = double(a.green) - b.green;
+    const double db = double(a.blue) - b.blue;
+    const double da = double(a.alpha) - b.alpha;
+    // some slack so rounding never rejects a match
+    if ((dr * dr) + (dg * dg) + (db * db) > (n * n * t.squared) * 1.000001 + 1)
+        return false;
+    if (fabs(da) > n * t.alpha)
+        return false;
+
+    auto deviation = [n](const Sums &sums) {
+        const double r = sums.red, g = sums.green, b = sums.blue, a = sums.alpha;
+        const double squares = double(sums.squares) - (((r * r) + (g * g) + (b * b) + (a * a)) / n);
+        return squares > 0 ? sqrt(squares) : 0.;
+    };
+    const double da2 = deviation(a);
+    const double db2 = deviation(b);
+    return fabs(da2 - db2) <= sqrt(n * (t.squared + (t.alpha * t.alpha))) + ((da2 + db2) * 1e-6) + 1e-3;
+}
+
+void Image::buildSums()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mSumsTable)
+        return;
+    const int w = width();
+    const int h = height();
+    const int stride = w + 1;
+    const Sums zero = { 0, 0, 0, 0, 0 };
+    mSums.resize(stride * (h + 1));
+    Sums *sums = mSums.data();
+    for (int x=0; x<stride; ++x)
+        sums[x] = zero;
+    for (int y=0; y<h; ++y) {
+        const quint32 *line = scanLine(mTop + y);
+        const Sums *above = sums + (y * stride);
+        Sums *row = sums + ((y + 1) * stride);
+        Sums lineSums = zero;
+        row[0] = zero;
+        for (int x=0; x<w; ++x) {
+            const quint32 red = (line[x] >> 16) & 0xff;
+            const quint32 green = (line[x] >> 8) & 0xff;
+            const quint32 blue = line[x] & 0xff;
+            const quint32 alpha = line[x] >> 24;
+            lineSums.red += red;
+            lineSums.green += green;
+            lineSums.blue += blue;
+            lineSums.alpha += alpha;
+            lineSums.squares += (red * red) + (green * green) + (blue * blue) + (alpha * alpha);
+            Sums &sum = row[x + 1];
+            sum.red = above[x + 1].red + lineSums.red;
+            sum.green = above[x + 1].green + lineSums.green;
+            sum.blue = above[x + 1].blue + lineSums.blue;
+            sum.alpha = above[x + 1].alpha + lineSums.alpha;
+            sum.squares = above[x + 1].squares + lineSums.squares;
+        }
+    }
+    mSumsTable = sums;
+}
+
+// Uncompressed inputs are mapped instead of decoded. 32-bit pixel data is
+// used in place, PPM and PAM without alpha are expanded straight from the
+// mapping. Returns false if fileName isn't one of these formats or is a
+// PPM or PAM that can't be mapped.
+bool Image::loadMapped(const QString &fileName, const QSize &rawSize, std::shared_ptr<Image> &image)
+{
+    const bool raw = fileName.endsWith(".bgra");
+    const QByteArray path = fileName.toLocal8Bit();
+    const int fd = open(path.constData(), O_RDONLY);
+    if (fd == -1)
+        return raw;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < 8) {
+        close(fd);
+        return raw;
+    }
+    char magic[2];
+    if (!raw && (read(fd, magic, 2) != 2 || magic[0] != 'P' || (magic[1] != '6' && magic[1] != '7'))) {
+        close(fd);
+        return false;
+    }
+    const size_t size = st.st_size;
+    void *mapped = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return raw;
+
+    const char *data = static_cast<const char *>(mapped);
+    size_t pos = 0;
+    int width = 0, height = 0, depth = 4, maxval = 255;
+    bool swapped = true;
+    if (raw) {
+        if (rawSize.isEmpty()) {
+            fprintf(stderr, "--raw-size is required for %s\n", path.constData());
+            munmap(mapped, size);
+            return true;
+        }
+        width = rawSize.width();
+        height = rawSize.height();
+        swapped = false;
+    } else {
+        auto token = [&]() {
+            QByteArray ret;
+            while (pos < size) {
+                if (data[pos] == '#') {
+                    while (pos < size && data[pos] != '\n')
+                        ++pos;
+                } else if (isspace(static_cast<unsigned char>(data[pos]))) {
+                    if (!ret.isEmpty())
+                        break;
+                    ++pos;
+                } else {
+                    ret.append(data + pos++, 1);
+                }
+            }
+            return ret;
+        };
+        pos = 2;
+        if (data[1] == '6') {
+            depth = 3;
+            width = token().toInt();
+            height = token().toInt();
+            maxval = token().toInt();
+        } else {
+            QByteArray tupleType;
+            while (pos < size) {
+                const QByteArray key = token();
+                if (key == "ENDHDR") {
+                    break;
+                } else if (key == "WIDTH") {
+                    width = token().toInt();
+                } else if (key == "HEIGHT") {
+                    height = token().toInt();
+                } else if (key == "DEPTH") {
+                    depth = token().toInt();
+                } else if (key == "MAXVAL") {
+                    maxval = token().toInt();
+                } else if (key == "TUPLTYPE") {
+                    tupleType = token();
+                }
+            }
+            if (depth == 4 && tupleType != "RGB_ALPHA")
+                depth = 0;
+        }
+        ++pos; // single whitespace after the header
+    }
+    const size_t bytesPerLine = size_t(width) * depth;
+    if (width <= 0 || height <= 0 || maxval != 255 || (depth != 3 && depth != 4)
+        || pos + (bytesPerLine * height) > size) {
+        munmap(mapped, size);
+        // other maxvals and depths are left to QImage
+        if (!raw)
+            return false;
+        fprintf(stderr, "Truncated image %s\n", path.constData());
+        return true;
+    }
+
+    image.reset(new Image);
+    image->mFileName = fileName;
+    image->mSize = QSize(width, height);
+    if (depth == 4 && !(pos % sizeof(quint32)) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN) {
+        image->mMapped = mapped;
+        image->mMappedSize = size;
+        image->mBits = reinterpret_cast<const uchar *>(data + pos);
+        image->mBytesPerLine = bytesPerLine;
+        image->mSwapped = swapped;
+        return true;
+    }
+
+    QImage converted(width, height, QImage::Format_ARGB32);
+    for (int y=0; y<height; ++y) {
+        const uchar *src = reinterpret_cast<const uchar *>(data + pos + (y * bytesPerLine));
+        QRgb *dst = reinterpret_cast<QRgb *>(converted.scanLine(y));
+        for (int x=0; x<width; ++x) {
+            const uchar *p = src + (x * depth);
+            if (depth == 3) {
+                dst[x] = qRgba(p[0], p[1], p[2], 0xff);
+            } else if (swapped) {
+                dst[x] = qRgba(p[0], p[1], p[2], p[3]);
+            } else {
+                dst[x] = qRgba(p[2], p[1], p[0], p[3]);
+            }
+        }
+    }
+    munmap(mapped, size);
+    image->mImage = converted;
+    image->mBits = converted.constBits();
+    image->mBytesPerLine = converted.bytesPerLine();
+    return true;
+}
+
+std::shared_ptr<Image> Image::fromBuffer(const uchar *bits, int width, int height, int bytesPerLine,
+                                         PixelFormat format, const QString &name)
+{
+    if (!bits || width <= 0 || height <= 0 || qint64(bytesPerLine) < qint64(width) * 4
+        || bytesPerLine % sizeof(quint32)) {
+        return std::shared_ptr<Image>();
+    }
+    if (format == RGBA8888 && Q_BYTE_ORDER != Q_LITTLE_ENDIAN) {
+        QImage converted(width, height, QImage::Format_ARGB32);
+        for (int y=0; y<height; ++y) {
+            const uchar *in = bits + (size_t(y) * bytesPerLine);
+            QRgb *out = reinterpret_cast<QRgb *>(converted.scanLine(y));
+            for (int x=0; x<width; ++x, in += 4)
+                out[x] = qRgba(in[0], in[1], in[2], in[3]);
+        }
+        return fromImage(converted, name);
+    }
+
+    std::shared_ptr<Image> ret(new Image);
+    ret->mFileName = name;
+    ret->mSize = QSize(width, height);
+    ret->mBits = bits;
+    ret->mBytesPerLine = bytesPerLine;
+    // on little endian rgba bytes are argb words with red and blue swapped
+    ret->mSwapped = format == RGBA8888;
+    return ret;
+}
+
+QByteArray Image::versionKey(const QString &fileName, const QSize &rawSize)
+{
+    struct stat st;
+    if (stat(fileName.toLocal8Bit().constData(), &st))
+        return QByteArray();
+    char key[64];
+    snprintf(key, sizeof(key), "|%lld|%lld.%09ld|%dx%d", static_cast<long long>(st.st_size),
+             static_cast<long long>(st.st_mtim.tv_sec), st.st_mtim.tv_nsec,
+             rawSize.width(), rawSize.height());
+    return key;
+}
+
+std::shared_ptr<Image> Image::load(const QString &fileName, const QSize &rawSize, const QString &cacheDir)
+{
+    QString cacheFile;
+    if (!cacheDir.isEmpty()) {
+        // keyed like the daemon's ImageCache, a changed file gets a new entry
+        const QByteArray key = versionKey(fileName, rawSize);
+        if (key.isEmpty())
+            return std::shared_ptr<Image>();
+        const QByteArray hash = QCryptographicHash::hash((QFileInfo(fileName).absoluteFilePath() + key).toUtf8(),
+                                                         QCryptographicHash::Md5);
+        cacheFile = cacheDir + "/" + QString::fromLatin1(hash.toHex().constData()) + ".img-sub";
+        std::shared_ptr<Image> cached = loadCached(cacheFile, fileName);
+        if (cached)
+            return cached;
+    }
+
+    std::shared_ptr<Image> ret;
+    if (!loadMapped(fileName, rawSize, ret)) {
+        const QImage image(fileName);
+        if (!image.isNull())
+            ret = fromImage(image, fileName);
+    }
+    if (ret && !cacheFile.isEmpty()) {
+        ret->buildSums();
+        if (!ret->saveCached(cacheFile))
+            fprintf(stderr, "Failed to write %s\n", qPrintable(cacheFile));
+    }
+    return ret;
+}
+
+// Cache files are a CacheHeader followed by the pixels, width * 4 bytes per
+// line, and the summed-area table, in the byte order of the machine that
+// wrote them
+struct CacheHeader
+{
+    char magic[8];
+    quint32 width, height;
+    quint32 swapped, sumsSize;
+    quint64 pixels, sums;
+};
+static const char cacheMagic[8] = { 'i', 'm', 'g', '-', 's', 'u', 'b', '1' };
+
+std::shared_ptr<Image> Image::loadCached(const QString &cacheFile, const QString &fileName)
+{
+    const int fd = open(cacheFile.toLocal8Bit().constData(), O_RDONLY);
+    if (fd == -1)
+        return std::shared_ptr<Image>();
+    struct stat st;
+    void *mapped = MAP_FAILED;
+    if (!fstat(fd, &st) && size_t(st.st_size) >= sizeof(CacheHeader))
+        mapped = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+        return std::shared_ptr<Image>();
+
+    const size_t size = st.st_size;
+    const char *data = static_cast<const char *>(mapped);
+    CacheHeader header;
+    memcpy(&header, data, sizeof(header));
+    const quint64 pixelsSize = quint64(header.width) * header.height * 4;
+    const quint64 sumsSize = quint64(header.width + 1) * (header.height + 1) * sizeof(Sums);
+    if (memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) || header.sumsSize != sizeof(Sums)
+        || !header.width || !header.height || header.pixels % 4 || header.sums % 8
+        || header.pixels + pixelsSize > size || header.sums + sumsSize > size) {
+        // written by some other version, it's replaced after decoding
+        munmap(mapped, size);
+        return std::shared_ptr<Image>();
+    }
+
+    std::shared_ptr<Image> image(new Image);
+    image->mFileName = fileName;
+    image->mSize = QSize(header.width, header.height);
+    image->mMapped = mapped;
+    image->mMappedSize = size;
+    image->mBits = reinterpret_cast<const uchar *>(data + header.pixels);
+    image->mBytesPerLine = header.width * 4;
+    image->mSwapped = header.swapped;
+    image->mSumsTable = reinterpret_cast<const Sums *>(data + header.sums);
+    return image;
+}
+
+bool Image::saveCached(const QString &cacheFile) const
+{
+    Q_ASSERT(mSumsTable && !mTop);
+    QDir().mkpath(QFileInfo(cacheFile).absolutePath());
+    // written next to it and renamed so no one maps a partial file
+    const QByteArray path = cacheFile.toLocal8Bit();
+    const QByteArray tmp = (cacheFile + "." + QString::number(getpid())).toLocal8Bit();
+    FILE *f = fopen(tmp.constData(), "w");
+    if (!f)
+        return false;
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.width = width();
+    header.height = height();
+    header.swapped = mSwapped;
+    header.sumsSize = sizeof(Sums);
+    header.pixels = sizeof(header);
+    header.sums = (header.pixels + (quint64(width()) * height() * 4) + 7) & ~quint64(7);
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (int y=0; ok && y<height(); ++y)
+        ok = fwrite(scanLine(y), width() * 4, 1, f) == 1;
+    static const char padding[8] = { 0 };
+    const size_t written = sizeof(header) + (size_t(width()) * height() * 4);
+    if (ok && header.sums > written)
+        ok = fwrite(padding, header.sums - written, 1, f) == 1;
+    const size_t sumsCount = size_t(width() + 1) * (height() + 1);
+    if (ok)
+        ok = fwrite(mSumsTable, sizeof(Sums), sumsCount, f) == sumsCount;
+    ok = !fclose(f) && ok && !rename(tmp.constData(), path.constData());
+    if (!ok)
+        unlink(tmp.constData());
+    return ok;
+}
+
+QDebug &operator<<(QDebug &debug, const Chunk &chunk)
+{
+    debug << "Chunk(" << chunk.image()->fileName() << chunk.rect() << ")";
+    return debug;
+}
+
+Chunk::Chunk(const Image *i, const QRect &r)
+    : mImage(i), mRect(r), mFlags(0), mColor(0)
+{
+    if (mImage) {
+        Q_ASSERT(!r.isNull());
+        Q_ASSERT(i->rect().contains(r));
+        const int xs[] = { mRect.left(), mRect.left() + (mRect.width() / 2), mRect.right() };
+        const int ys[] = { mRect.top(), mRect.top() + (mRect.height() / 2), mRect.bottom() };
+        for (int y=0; y<3; ++y) {
+            const quint32 *line = mImage->scanLine(ys[y]);
+            for (int x=0; x<3; ++x)
+                mProbes[(y * 3) + x] = mImage->pixel(line[xs[x]]);
+        }
+        Sums sums;
+        if (mImage->sums(mRect, &sums)) {
+            if (!sums.alpha)
+                mFlags |= AllTransparent;
+            // the sum of squares is only the squared sum over n when all
+            // pixels are the same
+            const quint32 n = quint32(mRect.width()) * mRect.height();
+            if (!(sums.red % n) && !(sums.green % n) && !(sums.blue % n) && !(sums.alpha % n)) {
+                const quint64 red = sums.red / n, green = sums.green / n, blue = sums.blue / n, alpha = sums.alpha / n;
+                if (sums.squares == n * ((red * red) + (green * green) + (blue * blue) + (alpha * alpha))) {
+                    mFlags |= Uniform;
+                    // sums() has red and blue in QRgb order already
+                    mColor = qRgba(red, green, blue, alpha);
+                }
+            }
+        } else {
+            mFlags |= AllTransparent;
+            ([this]() {
+                const int h = height();
+                const int w = width();
+                for (int y = 0; y<h; ++y) {
+                    const quint32 *line = mImage->scanLine(mRect.y() + y) + mRect.x();
+                    for (int x = 0; x<w; ++x) {
+                        if (line[x] & 0xff000000) {
+                            mFlags &= ~AllTransparent;
+                            return;
+                        }
+                    }
+                }
+            })();
+        }
+    }
+    Q_ASSERT(!mImage == r.isNull());
+}
+
+inline Color Chunk::color(int x, int y) const // x and y is in Chunk coordinates
+{
+    Q_ASSERT(mImage);
+    Q_ASSERT(x < mRect.width());
+    Q_ASSERT(y < mRect.height());
+    return mImage->color(mRect.x() + x, mRect.y() + y);
+}
+
+bool Chunk::compare(const Chunk &other, const Thresholds &thresholds, Stats *stats) const
+{
+    if (stats)
+        stats->comparisons.fetch_add(1, std::memory_order_relaxed);
+    if ((mFlags & AllTransparent) && (other.mFlags & AllTransparent))
+        return true;
+    Q_ASSERT(other.mRect.size() == mRect.size());
+    if ((mFlags & Uniform) && (other.mFlags & Uniform)) {
+        const bool ret = comparePixel(mColor, other.mColor, thresholds);
+        if (ret && stats)
+            stats->uniformHits.fetch_add(1, std::memory_order_relaxed);
+        return ret;
+    }
+    for (int i=0; i<ProbeCount; ++i) {
+        if (!comparePixel(mProbes[i], other.mProbes[i], thresholds)) {
+            if (stats)
+                stats->probeRejects.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+
+    const int h = height();
+    const int w = width();
+    Sums sums, otherSums;
+    if (mImage->sums(mRect, &sums) && other.mImage->sums(other.mRect, &otherSums)
+        && !sumsMayMatch(sums, otherSums, quint64(w) * h, thresholds)) {
+        if (stats)
+            stats->sumsRejects.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    // rows is how many rows were looked at before returning
+    auto done = [&](int rows, bool ret) {
+        if (stats) {
+            stats->pixelsCompared.fetch_add(quint64(rows) * w, std::memory_order_relaxed);
+            if (!ret)
+                stats->earlyExits.fetch_add(1, std::memory_order_relaxed);
+        }
+        return ret;
+    };
+    if (mImage->isSwapped() != other.mImage->isSwapped()) {
+        for (int y = 0; y<h; ++y) {
+            const quint32 *line = mImage->scanLine(mRect.y() + y) + mRect.x();
+            const quint32 *otherLine = other.mImage->scanLine(other.mRect.y() + y) + other.mRect.x();
+            for (int x = 0; x<w; ++x) {
+                if (!comparePixel(Image::swapRedBlue(line[x]), otherLine[x], thresholds))
+                    return done(y + 1, false);
+            }
+        }
+        return done(h, true);
+    }
+    for (int y = 0; y<h; ++y) {
+        if (!comparePixels(mImage->scanLine(mRect.y() + y) + mRect.x(),
+                           other.mImage->scanLine(other.mRect.y() + y) + other.mRect.x(), w, thresholds)) {
+            return done(y + 1, false);
+        }
+    }
+    return done(h, true);
+}
+
+Qt::Alignment Chunk::isAligned(const Chunk &other) const
+{
+    Qt::Alignment ret;
+    if (y() == other.y() && height() == other.height()) {
+        if (x() + width() == other.x()) {
+            ret |= Qt::AlignRight;
+        } else if (other.x() + other.width() == x()) {
+            ret |= Qt::AlignLeft;
+        }
+    } else if (x() == other.x() && width() == other.width()) {
+        if (y() + height() == other.y()) {
+            ret |= Qt::AlignBottom;
+        } else if (other.y() + other.height() == y()) {
+            ret |= Qt::AlignTop;
+        }
+    }
+    return ret;
+}
+
+void Chunk::save(const QString &fileName) const
+{
+    Q_ASSERT(mImage);
+    const QImage image = mImage->image().copy(mRect.translated(0, -mImage->rect().top()));
+    image.save(fileName);
+}
+
+void Chunk::adopt(const Chunk &other)
+{
+    Q_ASSERT(isAligned(other));
+    mRect = mRect.united(other.rect());
+    Q_ASSERT(mImage->rect().contains(mRect));
+}
+
+// Joins matches whose rects are adjacent in both images. The result is the
+// same as repeatedly joining the first match that has a partner with its
+// first partner, but partners are looked up by corner instead of by
+// scanning all matches. New rects never overlap so a corner identifies at
+// most one match.
+void joinChunks(QVector<std::pair<Chunk, Chunk> > &chunks, int verbose)
+{
+    auto key = [](int x, int y) { return (quint64(quint32(x)) << 32) | quint32(y); };
+    QHash<quint64, int> topLefts, topRights, bottomLefts;
+    auto index = [&](int i) {
+        const QRect r = chunks.at(i).first.rect();
+        topLefts[key(r.left(), r.top())] = i;
+        topRights[key(r.right(), r.top())] = i;
+        bottomLefts[key(r.left(), r.bottom())] = i;
+    };
+    auto unindex = [&](int i) {
+        const QRect r = chunks.at(i).first.rect();
+        topLefts.remove(key(r.left(), r.top()));
+        topRights.remove(key(r.right(), r.top()));
+        bottomLefts.remove(key(r.left(), r.bottom()));
+    };
+    // the matches to the right, left, below and above, -1 if there is none
+    auto neighbors = [&](int i, int *ret) {
+        const QRect r = chunks.at(i).first.rect();
+        ret[0] = topLefts.value(key(r.right() + 1, r.top()), -1);
+        ret[1] = topRights.value(key(r.left() - 1, r.top()), -1);
+        ret[2] = topLefts.value(key(r.left(), r.bottom() + 1), -1);
+        ret[3] = bottomLefts.value(key(r.left(), r.top() - 1), -1);
+    };
+
+    std::set<int> pending;
+    for (int i=0; i<chunks.size(); ++i) {
+        index(i);
+        pending.insert(i);
+    }
+    QVector<bool> removed(chunks.size(), false);
+    while (!pending.empty()) {
+        const int i = *pending.begin();
+        Chunk &chunk = chunks[i].first;
+        Chunk &otherChunk = chunks[i].second;
+        int partner = -1;
+        if (chunk.rect() != otherChunk.rect()) {
+            int candidates[4];
+            neighbors(i, candidates);
+            for (int j : candidates) {
+                if (j <= i || (partner != -1 && j > partner))
+                    continue;
+                const Chunk &maybeChunk = chunks.at(j).first;
+                if ((chunk.flags() & Chunk::AllTransparent) != (maybeChunk.flags() & Chunk::AllTransparent))
+                    continue;
+                // matches from different references don't join
+                if (otherChunk.image() != chunks.at(j).second.image())
+                    continue;
+                const Qt::Alignment aligned = chunk.isAligned(maybeChunk);
+                if (verbose >= 2) {
+                    qDebug() << "comparing" << chunk.rect() << maybeChunk.rect() << aligned
+                             << otherChunk.rect() << chunks.at(j).second.rect()
+                             << otherChunk.isAligned(chunks.at(j).second);
+                }
+                if (aligned && otherChunk.isAligned(chunks.at(j).second) == aligned)
+                    partner = j;
+            }
+        }
+        if (partner == -1) {
+            pending.erase(pending.begin());
+            continue;
+        }
+
+        if (verbose)
+            qDebug() << "chunk" << i << chunk.rect() << "was joined with chunk" << partner << chunks.at(partner).first.rect();
+        unindex(i);
+        unindex(partner);
+        chunk.adopt(chunks.at(partner).first);
+        otherChunk.adopt(chunks.at(partner).second);
+        removed[partner] = true;
+        pending.erase(partner);
+        index(i);
+        // earlier matches that couldn't be joined before might fit the bigger rect
+        int candidates[4];
+        neighbors(i, candidates);
+        for (int j : candidates) {
+            if (j != -1 && j < i)
+                pending.insert(j);
+        }
+    }
+
+    int count = 0;
+    for (int i=0; i<chunks.size(); ++i) {
+        if (!removed.at(i))
+            chunks[count++] = chunks.at(i);
+    }
+    chunks.resize(count);
+}
+
+// Polynomial hashes over 2D windows, rows are hashed with RowBase and the
+// row hashes of a window are combined with ColumnBase.
+static const quint64 RowBase = 0x9e3779b97f4a7c15ull;
+static const quint64 ColumnBase = 0xc2b2ae3d27d4eb4full;
+
+static quint64 hashRect(const Image &image, const QRect &rect)
+{
+    quint64 hash = 0;
+    for (int y=rect.y(); y<=rect.bottom(); ++y) {
+        const quint32 *line = image.scanLine(y);
+        quint64 row = 0;
+        for (int x=rect.x(); x<=rect.right(); ++x)
+            row = (row * RowBase) + image.pixel(line[x]);
+        hash = (hash * ColumnBase) + row;
+    }
+    return hash;
+}
+
+// Looks for the new chunks at every position of oldImage inside bounds. The
+// hash of each window of a chunk's size is rolled over bounds in raster
+// order and looked up among the hashes of the new chunks, hits are verified
+// with Chunk::compare. Only finds exact matches. Chunks that already have an
+// entry in found are skipped.
+static void findMoved(const std::shared_ptr<Image> &oldImage, const QRect &bounds,
+                      const QVector<Chunk> &newChunks, QVector<Chunk> &found,
+                      ThreadPool &pool, Stats *stats)
+{
+    QVector<QSize> sizes;
+    for (int i=0; i<newChunks.size(); ++i) {
+        if (newChunks.at(i).isValid() && !found.at(i).isValid() && !sizes.contains(newChunks.at(i).size()))
+            sizes.push_back(newChunks.at(i).size());
+    }
+    const Image &image = *oldImage;
+    for (const QSize &size : sizes) {
+        const int w = size.width();
+        const int h = size.height();
+        const int positionsX = bounds.width() - w + 1;
+        const int positionsY = bounds.height() - h + 1;
+        if (positionsX < 1 || positionsY < 1 || (positionsX == 1 && positionsY == 1 && bounds == image.rect()))
+            continue;
+
+        QHash<quint64, QVector<int> > wanted;
+        // cheap first check before the QHash lookup
+        QVector<quint64> bloom(1024, 0);
+        for (int i=0; i<newChunks.size(); ++i) {
+            const Chunk &chunk = newChunks.at(i);
+            if (chunk.isValid() && !found.at(i).isValid() && chunk.size() == size) {
+                const quint64 hash = hashRect(*chunk.image(), chunk.rect());
+                wanted[hash].push_back(i);
+                bloom[(hash >> 6) & 1023] |= (1ull << (hash & 63));
+            }
+        }
+
+        quint64 rowPower = 1, columnPower = 1;
+        for (int i=0; i<w; ++i)
+            rowPower *= RowBase;
+        for (int i=0; i<h; ++i)
+            columnPower *= ColumnBase;
+
+        // hashes of all w wide windows of row y
+        const int left = bounds.left();
+        auto hashRow = [&](int y, quint64 *out) {
+            const quint32 *line = image.scanLine(y) + left;
+            quint64 row = 0;
+            for (int x=0; x<w; ++x)
+                row = (row * RowBase) + image.pixel(line[x]);
+            out[0] = row;
+            for (int x=1; x<positionsX; ++x) {
+                row = (row * RowBase) - (image.pixel(line[x - 1]) * rowPower) + image.pixel(line[x + w - 1]);
+                out[x] = row;
+            }
+        };
+
+        // Each band of rows is rolled separately and keeps the first hit for
+        // each chunk, the first band with a hit wins so the result is the
+        // same as one pass in raster order.
+        const int bandCount = qMin(positionsY, pool.count() == 1 ? 1 : pool.count() * 4);
+        const int top = bounds.top();
+        int wantedCount = 0;
+        for (QHash<quint64, QVector<int> >::const_iterator it = wanted.constBegin(); it != wanted.constEnd(); ++it)
+            wantedCount += it.value().size();
+        QVector<QVector<Chunk> > bands(bandCount);
+        QVector<Chunk> *bandResults = bands.data();
+        pool.run(bandCount, [&](int band) {
+            const int first = top + ((positionsY * band) / bandCount);
+            const int last = top + ((positionsY * (band + 1)) / bandCount);
+            QVector<Chunk> &bandFound = bandResults[band];
+            bandFound.resize(newChunks.size());
+            int remaining = wantedCount;
+
+            QVector<quint64> windows(positionsX, 0), leaving(positionsX), entering(positionsX);
+            for (int y=first; y<first + h; ++y) {
+                hashRow(y, entering.data());
+                for (int x=0; x<positionsX; ++x)
+                    windows[x] = (windows[x] * ColumnBase) + entering[x];
+            }
+            for (int y=first; remaining && y<last; ++y) {
+                if (y != first) {
+                    hashRow(y - 1, leaving.data());
+                    hashRow(y + h - 1, entering.data());
+                    for (int x=0; x<positionsX; ++x)
+                        windows[x] = (windows[x] * ColumnBase) - (leaving[x] * columnPower) + entering[x];
+                }
+                for (int x=0; remaining && x<positionsX; ++x) {
+                    const quint64 hash = windows[x];
+                    if (!(bloom[(hash >> 6) & 1023] & (1ull << (hash & 63))))
+                        continue;
+                    const QHash<quint64, QVector<int> >::const_iterator it = wanted.constFind(hash);
+                    if (it == wanted.constEnd())
+                        continue;
+                    const Chunk candidate = oldImage->chunk(QRect(left + x, y, w, h));
+                    if (stats)
+                        stats->chunks.fetch_add(1, std::memory_order_relaxed);
+                    for (int idx : it.value()) {
+                        if (!bandFound.at(idx).isValid() && newChunks.at(idx).compare(candidate, Thresholds(), stats)) {
+                            bandFound[idx] = candidate;
+                            --remaining;
+                        }
+                    }
+                }
+            }
+        });
+        for (int i=0; i<newChunks.size(); ++i) {
+            for (int band=0; !found.at(i).isValid() && band<bandCount; ++band)
+                found[i] = bands.at(band).at(i);
+        }
+    }
+}
+
+// The offsets that matched content moved by, kept for cells of --min-size
+// pixels. Content mostly moves together so the offsets next to a chunk are
+// the best guesses for where it came from.
+class MotionField
+{
+public:
+    enum { MaxPredictions = 4 };
+
+    MotionField(const QRect &rect, int cell)
+        : mRect(rect), mCell(cell), mColumns((rect.width() + cell - 1) / cell),
+          mCells(mColumns * ((rect.height() + cell - 1) / cell), -1), mMaxX(0), mMaxY(0)
+    {}
+
+    void add(const QRect &newRect, const QRect &oldRect)
+    {
+        const QPoint offset = oldRect.topLeft() - newRect.topLeft();
+        const QRect rect = newRect.intersected(mRect);
+        if (offset.isNull() || rect.isEmpty())
+            return;
+        const quint64 key = (quint64(quint32(offset.x())) << 32) | quint32(offset.y());
+        const QHash<quint64, int>::const_iterator it = mIndexes.constFind(key);
+        int index;
+        if (it == mIndexes.constEnd()) {
+            index = mOffsets.size();
+            mOffsets.push_back(offset);
+            mIndexes.insert(key, index);
+        } else {
+            index = it.value();
+        }
+        for (int y=(rect.top() - mRect.top()) / mCell; y<=(rect.bottom() - mRect.top()) / mCell; ++y) {
+            for (int x=(rect.left() - mRect.left()) / mCell; x<=(rect.right() - mRect.left()) / mCell; ++x)
+                mCells[(y * mColumns) + x] = index;
+        }
+        mMaxX = qMax(mMaxX, qAbs(offset.x()));
+        mMaxY = qMax(mMaxY, qAbs(offset.y()));
+    }
+
+    // The distinct offsets of the cells just outside rect, returns how many
+    // were written to out
+    int predict(const QRect &rect, QPoint *out) const
+    {
+        int count = 0;
+        int indexes[MaxPredictions];
+        auto visit = [&](int x, int y) {
+            if (count == MaxPredictions || !mRect.contains(x, y))
+                return;
+            const int index = mCells.at((((y - mRect.top()) / mCell) * mColumns) + ((x - mRect.left()) / mCell));
+            if (index == -1)
+                return;
+            for (int i=0; i<count; ++i) {
+                if (indexes[i] == index)
+                    return;
+            }
+            indexes[count] = index;
+            out[count++] = mOffsets.at(index);
+        };
+        const int left = rect.left() - 1, right = rect.right() + 1;
+        const int top = rect.top() - 1, bottom = rect.bottom() + 1;
+        for (int x=left; x<right; x += mCell) {
+            visit(x, top);
+            visit(x, bottom);
+        }
+        for (int y=top; y<bottom; y += mCell) {
+            visit(left, y);
+            visit(right, y);
+        }
+        visit(right, bottom);
+        return count;
+    }
+
+    // How many cells of size cell around a chunk are worth trying: --range
+    // if it was given, otherwise one more than the furthest move seen so far
+    // and at least --range's default
+    int radius(const QSize &cell, const Options &options) const
+    {
+        if (options.hasRange)
+            return options.range;
+        const int motion = qMax((mMaxX + cell.width() - 1) / cell.width(), (mMaxY + cell.height() - 1) / cell.height());
+        return qMax(options.range, motion + 1);
+    }
+private:
+    QRect mRect;
+    int mCell, mColumns;
+    QVector<int> mCells;
+    QVector<QPoint> mOffsets;
+    QHash<quint64, int> mIndexes;
+    int mMaxX, mMaxY;
+};
+
+// Extends offsets to the cells up to radius cells away, nearest first, so
+// the first (2 * radius + 1)^2 are the ones within radius. Only the rings
+// that aren't there yet are added, searches grow it as the moves they find
+// call for a larger radius instead of allocating all of --range up front.
+static void spiral(int radius, QVector<QPoint> &offsets)
+{
+    if (offsets.isEmpty())
+        offsets.push_back(QPoint(0, 0));
+    for (int ring=1; ring<=radius; ++ring) {
+        if (offsets.size() >= (2 * ring + 1) * (2 * ring + 1))
+            continue;
+        for (int y=-ring; y<=ring; ++y) {
+            if (qAbs(y) == ring) {
+                for (int x=-ring; x<=ring; ++x)
+                    offsets.push_back(QPoint(x, y));
+            } else {
+                offsets.push_back(QPoint(-ring, y));
+                offsets.push_back(QPoint(ring, y));
+            }
+        }
+    }
+}
+
+// Quadtree over an image's rect. Children are stored after their parent,
+// a node that can't be split in both directions is split in the one that
+// it can, nodes are never smaller than minSize.
+struct QuadNode
+{
+    QRect rect;
+    int firstChild, childCount;
+};
+
+static QVector<QuadNode> buildQuadtree(const QRect &rect, int minSize)
+{
+    QVector<QuadNode> nodes;
+    const QuadNode root = { rect, -1, 0 };
+    nodes.push_back(root);
+    for (int i=0; i<nodes.size(); ++i) {
+        const QRect r = nodes.at(i).rect;
+        const int columns = r.width() / 2 >= minSize ? 2 : 1;
+        const int rows = r.height() / 2 >= minSize ? 2 : 1;
+        if (columns * rows == 1)
+            continue;
+        nodes[i].firstChild = nodes.size();
+        nodes[i].childCount = columns * rows;
+        const int w = r.width() / columns;
+        const int h = r.height() / rows;
+        for (int y=0; y<rows; ++y) {
+            for (int x=0; x<columns; ++x) {
+                const QuadNode child = {
+                    QRect(r.x() + (x * w), r.y() + (y * h),
+                          x + 1 == columns ? r.width() - (x * w) : w,
+                          y + 1 == rows ? r.height() - (y * h) : h),
+                    -1, 0
+                };
+                nodes.push_back(child);
+            }
+        }
+    }
+    return nodes;
+}
+
+// hashRect() of every node, leaves are hashed and parents are combined from
+// their children so every pixel is only read once
+static QVector<quint64> hashQuadtree(const Image &image, const QVector<QuadNode> &nodes)
+{
+    QVector<quint64> hashes(nodes.size());
+    auto power = [](quint64 base, int exponent) {
+        quint64 ret = 1;
+        while (exponent--)
+            ret *= base;
+        return ret;
+    };
+    for (int i=nodes.size() - 1; i>=0; --i) {
+        const QuadNode &node = nodes.at(i);
+        if (!node.childCount) {
+            hashes[i] = hashRect(image, node.rect);
+            continue;
+        }
+        // the children are laid out row by row
+        const QuadNode &last = nodes.at(node.firstChild + node.childCount - 1);
+        const int columns = node.childCount == 4 || last.rect.y() == node.rect.y() ? 2 : 1;
+        const quint64 rightPower = power(RowBase, last.rect.width());
+        const quint64 bottomPower = power(ColumnBase, last.rect.height());
+        quint64 hash = 0;
+        for (int c=0; c<node.childCount; ++c) {
+            const bool left = columns == 2 && c % 2 == 0;
+            const bool top = c / columns == 0 && node.childCount / columns == 2;
+            quint64 child = hashes.at(node.firstChild + c);
+            if (left)
+                child *= rightPower;
+            if (top)
+                child *= bottomPower;
+            hash += child;
+        }
+        hashes[i] = hash;
+    }
+    return hashes;
+}
+
+// hashQuadtree() of nodes, which must be buildQuadtree(rect, minSize),
+// cached in image so it's only computed once per image when diffing a
+// sequence or running as a daemon
+QVector<quint64> quadtreeHashes(const Image &image, const QRect &rect, int minSize, const QVector<QuadNode> &nodes)
+{
+    std::lock_guard<std::mutex> lock(image.mMutex);
+    if (image.mQuadtreeMinSize != minSize || image.mQuadtreeRect != rect) {
+        image.mQuadtreeHashes = hashQuadtree(image, nodes);
+        image.mQuadtreeRect = rect;
+        image.mQuadtreeMinSize = minSize;
+    }
+    return image.mQuadtreeHashes;
+}
+
+// The index of the reference oldChunk is in, a band() counts as the image
+// it was made from
+static int referenceOf(const Chunk &oldChunk, const QVector<std::shared_ptr<Image> > &oldImages)
+{
+    for (int i=0; i<oldImages.size(); ++i) {
+        if (oldImages.at(i)->source() == oldChunk.image()->source())
+            return i;
+    }
+    Q_ASSERT(0);
+    return 0;
+}
+
+// Passes matches from on to provisional
+static void report(const MatchCallback &provisional, const QVector<std::shared_ptr<Image> > &oldImages,
+                   const QVector<std::pair<Chunk, Chunk> > &matches, int from)
+{
+    if (!provisional || from >= matches.size())
+        return;
+    QVector<Match> ret(matches.size() - from);
+    for (int i=from; i<matches.size(); ++i) {
+        Match &match = ret[i - from];
+        match.oldRect = matches.at(i).second.rect();
+        match.newRect = matches.at(i).first.rect();
+        match.transparent = matches.at(i).first.flags() & Chunk::AllTransparent;
+        match.reference = referenceOf(matches.at(i).second, oldImages);
+    }
+    provisional(ret);
+}
+
+// Where the content of a new chunk can have moved from in oldImage, with
+// damage it has to come from the bounding rect of the damaged area too
+static QRect moveBounds(const Image &oldImage, const Options &options)
+{
+    QRect damaged;
+    for (const QRect &rect : options.damage)
+        damaged = damaged.united(rect);
+    return options.hasDamage ? oldImage.rect().intersected(damaged) : oldImage.rect();
+}
+
+// Coarse to fine search. Starts with the whole image and only splits the
+// nodes that weren't found in any of the old images, so after the first few
+// levels the work is proportional to the area that changed. motions has a
+// MotionField per old image.
+static void searchQuadtree(const QVector<std::shared_ptr<Image> > &oldImages, const std::shared_ptr<Image> &newImage,
+                           const Options &options, const Thresholds &thresholds, ThreadPool &pool,
+                           std::vector<MotionField> &motions, Occupancy &used,
+                           QVector<std::pair<Chunk, Chunk> > &matches, Stats *stats, const MatchCallback &provisional)
+{
+    QVector<QPoint> offsets;
+    const QVector<QuadNode> nodes = buildQuadtree(newImage->rect(), options.minSize);
+    // with exact matching unmoved nodes can be rejected by hash
+    const bool exact = thresholds.isExact();
+    QVector<QVector<quint64> > oldHashes(oldImages.size());
+    QVector<quint64> newHashes;
+    if (exact) {
+        for (int reference=0; reference<oldImages.size(); ++reference)
+            oldHashes[reference] = quadtreeHashes(*oldImages.at(reference), newImage->rect(), options.minSize, nodes);
+        newHashes = quadtreeHashes(*newImage, newImage->rect(), options.minSize, nodes);
+    }
+
+    // reused for every level, reserving keeps Qt from freeing them when
+    // they shrink
+    QVector<int> level, next;
+    QVector<Chunk> newChunks, found;
+    level.reserve(64);
+    next.reserve(64);
+    newChunks.reserve(64);
+    found.reserve(64);
+    level.push_back(0);
+    QElapsedTimer timer;
+    while (!level.isEmpty()) {
+        if (stats)
+            timer.start();
+        // nodes that are covered already, by matches or by being outside of
+        // the damage, are dropped and the ones that are partly covered are
+        // split without being searched
+        next.resize(0);
+        int searched = 0;
+        for (int i=0; i<level.size(); ++i) {
+            const QuadNode &node = nodes.at(level.at(i));
+            if (used.contains(node.rect))
+                continue;
+            if (used.intersects(node.rect)) {
+                for (int c=0; c<node.childCount; ++c)
+                    next.push_back(node.firstChild + c);
+                continue;
+            }
+            level[searched++] = level.at(i);
+        }
+        level.resize(searched);
+        found.fill(Chunk(), level.size());
+        Chunk *results = found.data();
+        newChunks.resize(level.size());
+        for (int i=0; i<level.size(); ++i)
+            newChunks[i] = newImage->chunk(nodes.at(level.at(i)).rect);
+        // every old image is tried for the nodes of the level before any of
+        // them are split, a node is taken from the first one it's found in
+        for (int reference=0; reference<oldImages.size(); ++reference) {
+            const std::shared_ptr<Image> &oldImage = oldImages.at(reference);
+            const MotionField &motion = motions.at(reference);
+            const QRect bounds = moveBounds(*oldImage, options);
+            // moves further than the old image is wide or tall in cells of a
+            // node's size can't be in it
+            auto radius = [&](const QSize &size) {
+                const int cells = qMax((oldImage->width() + size.width() - 1) / size.width(),
+                                       (oldImage->height() + size.height() - 1) / size.height());
+                return qMin(motion.radius(size, options), cells);
+            };
+            int maxRadius = 0;
+            for (int i=0; i<level.size(); ++i)
+                maxRadius = qMax(maxRadius, radius(nodes.at(level.at(i)).rect.size()));
+            spiral(maxRadius, offsets);
+            pool.run(level.size(), [&](int i) {
+                if (results[i].isValid())
+                    return;
+                const Chunk &newChunk = newChunks.at(i);
+                const QRect rect = newChunk.rect();
+                auto candidate = [&](const QRect &r, bool predicted) {
+                    if (!bounds.contains(r))
+                        return false;
+                    const Chunk oldChunk = oldImage->chunk(r);
+                    if (stats) {
+                        stats->chunks.fetch_add(1, std::memory_order_relaxed);
+                        stats->candidates.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    if (options.verbose >= 2) {
+                        qDebug() << "comparing chunks" << newChunk << oldChunk;
+                    }
+                    if (!newChunk.compare(oldChunk, thresholds, stats))
+                        return false;
+                    results[i] = oldChunk;
+                    if (predicted && stats)
+                        stats->predictedHits.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                };
+                if ((!exact || oldHashes.at(reference).at(level.at(i)) == newHashes.at(level.at(i)))
+                    && candidate(rect, false)) {
+                    return;
+                }
+                QPoint predictions[MotionField::MaxPredictions];
+                const int predictionCount = motion.predict(rect, predictions);
+                for (int p=0; p<predictionCount; ++p) {
+                    if (candidate(rect.translated(predictions[p]), true))
+                        return;
+                }
+                const int r = radius(rect.size());
+                for (int o=1; o<(2 * r + 1) * (2 * r + 1); ++o) {
+                    const QPoint offset(offsets.at(o).x() * rect.width(), offsets.at(o).y() * rect.height());
+                    bool predicted = false;
+                    for (int p=0; !predicted && p<predictionCount; ++p)
+                        predicted = predictions[p] == offset;
+                    if (!predicted && candidate(rect.translated(offset), false))
+                        return;
+                }
+            });
+        }
+
+        const int levelStart = matches.size();
+        int foundCount = 0;
+        for (int i=0; i<level.size(); ++i) {
+            const QuadNode &node = nodes.at(level.at(i));
+            if (found.at(i).isValid()) {
+                used.add(node.rect);
+                motions[referenceOf(found.at(i), oldImages)].add(node.rect, found.at(i).rect());
+                matches.push_back(std::make_pair(newChunks.at(i), found.at(i)));
+                ++foundCount;
+            } else {
+                for (int c=0; c<node.childCount; ++c)
+                    next.push_back(node.firstChild + c);
+            }
+        }
+        if (stats) {
+            const Stats::Level l = { stats->levels.size() + 1, timer.nsecsElapsed(), level.size(), foundCount };
+            stats->levels.push_back(l);
+            stats->chunks.fetch_add(level.size(), std::memory_order_relaxed);
+        }
+        report(provisional, oldImages, matches, levelStart);
+        level.swap(next);
+    }
+}
+
+// Hashes of each row of rect, or of each column with columns
+static QVector<quint64> lineHashes(const Image &image, const QRect &rect, bool columns)
+{
+    QVector<quint64> ret(columns ? rect.width() : rect.height(), 0);
+    quint64 *hashes = ret.data();
+    for (int y=rect.y(); y<=rect.bottom(); ++y) {
+        const quint32 *line = image.scanLine(y);
+        if (columns) {
+            for (int x=rect.x(); x<=rect.right(); ++x)
+                hashes[x - rect.x()] = (hashes[x - rect.x()] * ColumnBase) + image.pixel(line[x]);
+        } else {
+            quint64 row = 0;
+            for (int x=rect.x(); x<=rect.right(); ++x)
+                row = (row * RowBase) + image.pixel(line[x]);
+            hashes[y - rect.y()] = row;
+        }
+    }
+    return ret;
+}
+
+// Finds content that scrolled vertically (or horizontally) by matching
+// hashes of whole rows (columns) instead of chunks. Only the columns (rows)
+// that changed are hashed, so fixed panels beside a scrolled pane don't
+// hide the scroll. Lines that occur once in oldImage vote for the offset
+// they moved by, and the runs of at least minSize lines that moved by the
+// winning offset are added as matches. Returns true if any were.
+static bool findScroll(const std::shared_ptr<Image> &oldImage, const std::shared_ptr<Image> &newImage, bool vertical,
+                       int minSize, Occupancy &used, QVector<std::pair<Chunk, Chunk> > &matches, Stats *stats)
+{
+    const QRect rect = newImage->rect();
+    const QVector<quint64> oldAcross = lineHashes(*oldImage, rect, vertical);
+    const QVector<quint64> newAcross = lineHashes(*newImage, rect, vertical);
+    int first = 0, last = newAcross.size() - 1;
+    while (first <= last && oldAcross.at(first) == newAcross.at(first))
+        ++first;
+    while (last >= first && oldAcross.at(last) == newAcross.at(last))
+        --last;
+    if (last - first + 1 < minSize)
+        return false;
+
+    // in hash and quadtree mode oldImage can be taller than newImage, see
+    // searchBands()
+    QRect oldSpan, newSpan;
+    if (vertical) {
+        newSpan = QRect(rect.x() + first, rect.y(), last - first + 1, rect.height());
+        oldSpan = QRect(newSpan.x(), oldImage->rect().y(), newSpan.width(), oldImage->height());
+    } else {
+        newSpan = QRect(rect.x(), rect.y() + first, rect.width(), last - first + 1);
+        oldSpan = newSpan;
+    }
+    const QVector<quint64> oldAlong = lineHashes(*oldImage, oldSpan, !vertical);
+    const QVector<quint64> newAlong = lineHashes(*newImage, newSpan, !vertical);
+    const int oldStart = vertical ? oldSpan.y() : oldSpan.x();
+    const int newStart = vertical ? newSpan.y() : newSpan.x();
+    auto unchanged = [&](int i) { return oldAlong.at(newStart + i - oldStart) == newAlong.at(i); };
+
+    // -1 for lines that occur more than once
+    QHash<quint64, int> oldLines;
+    for (int i=0; i<oldAlong.size(); ++i) {
+        const QHash<quint64, int>::iterator it = oldLines.find(oldAlong.at(i));
+        if (it == oldLines.end()) {
+            oldLines.insert(oldAlong.at(i), oldStart + i);
+        } else {
+            it.value() = -1;
+        }
+    }
+    QHash<int, int> votes;
+    int offset = 0, best = 0;
+    for (int i=0; i<newAlong.size(); ++i) {
+        if (unchanged(i))
+            continue;
+        const int oldPos = oldLines.value(newAlong.at(i), -1);
+        if (oldPos == -1)
+            continue;
+        const int count = ++votes[newStart + i - oldPos];
+        if (count > best) {
+            best = count;
+            offset = newStart + i - oldPos;
+        }
+    }
+    if (!best)
+        return false;
+
+    auto add = [&](const QRect &newRect, const QRect &oldRect) {
+        if (newRect.width() < minSize || newRect.height() < minSize || used.intersects(newRect))
+            return false;
+        const Chunk newChunk = newImage->chunk(newRect);
+        const Chunk oldChunk = oldImage->chunk(oldRect);
+        if (stats)
+            stats->chunks.fetch_add(1, std::memory_order_relaxed);
+        if (!newChunk.compare(oldChunk, Thresholds(), stats))
+            return false;
+        used.add(newRect);
+        matches.push_back(std::make_pair(newChunk, oldChunk));
+        return true;
+    };
+
+    bool found = false;
+    int runStart = -1;
+    for (int i=0; i<=newAlong.size(); ++i) {
+        const int oldIndex = newStart + i - offset - oldStart;
+        if (i < newAlong.size() && oldIndex >= 0 && oldIndex < oldAlong.size()
+            && oldAlong.at(oldIndex) == newAlong.at(i)) {
+            if (runStart == -1)
+                runStart = i;
+            continue;
+        }
+        if (runStart == -1)
+            continue;
+        // lines that are the same in place either way aren't part of the scroll
+        int start = runStart, end = i;
+        runStart = -1;
+        while (start < end && unchanged(start))
+            ++start;
+        while (end > start && unchanged(end - 1))
+            --end;
+        const QRect newRect = vertical
+                              ? QRect(newSpan.x(), newStart + start, newSpan.width(), end - start)
+                              : QRect(newStart + start, newSpan.y(), end - start, newSpan.height());
+        const QRect oldRect = vertical ? newRect.translated(0, -offset) : newRect.translated(-offset, 0);
+        if (add(newRect, oldRect)) {
+            if (stats)
+                ++stats->scrollRects;
+            found = true;
+        }
+    }
+    if (found) {
+        // the chunks of the search would mostly overlap the scroll so the
+        // unchanged lines beside it are added here
+        const QRect before = vertical ? QRect(rect.x(), rect.y(), first, rect.height())
+                                      : QRect(rect.x(), rect.y(), rect.width(), first);
+        const QRect after = vertical ? QRect(newSpan.right() + 1, rect.y(), rect.right() - newSpan.right(), rect.height())
+                                     : QRect(rect.x(), newSpan.bottom() + 1, rect.width(), rect.bottom() - newSpan.bottom());
+        add(before, before);
+        add(after, after);
+    }
+    return found;
+}
+
+// earlier are the matches of the band above when searching in bands, they
+// only seed the predictions
+static void searchImage(const QVector<std::shared_ptr<Image> > &oldImages, const std::shared_ptr<Image> &newImage,
+                        const Options &options, ThreadPool &pool,
+                        Occupancy &used, QVector<std::pair<Chunk, Chunk> > &matches, Stats *stats,
+                        const MatchCallback &provisional,
+                        const QVector<std::pair<Chunk, Chunk> > &earlier = QVector<std::pair<Chunk, Chunk> >())
+{
+    QVector<QPoint> offsets;
+    const Thresholds thresholds(options.threshold);
+    const int minSize = options.minSize;
+
+    for (const std::shared_ptr<Image> &oldImage : oldImages)
+        oldImage->buildSums();
+    newImage->buildSums();
+    if (options.scroll) {
+        const int from = matches.size();
+        for (const std::shared_ptr<Image> &oldImage : oldImages) {
+            if (!findScroll(oldImage, newImage, true, minSize, used, matches, stats))
+                findScroll(oldImage, newImage, false, minSize, used, matches, stats);
+        }
+        report(provisional, oldImages, matches, from);
+    }
+    // earlier bands, scrolls and levels predict the moves of this one, each
+    // old image has a field of its own. The field reaches a cell past the
+    // band so the matches at the bottom of the band above are next to the
+    // chunks at its top.
+    std::vector<MotionField> motions;
+    motions.reserve(oldImages.size());
+    for (int reference=0; reference<oldImages.size(); ++reference)
+        motions.push_back(MotionField(newImage->rect().adjusted(0, -minSize, 0, minSize), minSize));
+    for (const auto &match : earlier)
+        motions[referenceOf(match.second, oldImages)].add(match.first.rect(), match.second.rect());
+    for (const auto &match : matches)
+        motions[referenceOf(match.second, oldImages)].add(match.first.rect(), match.second.rect());
+    int count = 1;
+    if (options.mode == QuadtreeMode)
+        searchQuadtree(oldImages, newImage, options, thresholds, pool, motions, used, matches, stats, provisional);
+    QElapsedTimer timer;
+    // reused for every level and old image
+    QVector<Chunk> newChunks, oldChunks, found;
+    QHash<QRgb, QVector<int> > uniformCells;
+    while (options.mode != QuadtreeMode) {
+        if (stats)
+            timer.start();
+        if (!newImage->chunks(count, minSize, newChunks, &used))
+            break;
+        found.fill(Chunk(), newChunks.size());
+        Chunk *results = found.data();
+        int oldChunkCount = 0;
+        // every old image is tried for the chunks of the level before going
+        // finer, a chunk is taken from the first one it's found in
+        for (int reference=0; reference<oldImages.size(); ++reference) {
+            const std::shared_ptr<Image> &oldImage = oldImages.at(reference);
+            const MotionField &motion = motions.at(reference);
+            const QRect bounds = moveBounds(*oldImage, options);
+            // in hash mode oldImage can be taller than newImage, see searchBands()
+            oldImage->chunks(count, minSize, oldChunks);
+            oldChunkCount += oldChunks.size();
+            // in hash mode a uniform chunk that moved is cut from an old cell
+            // of the same color instead of being looked for by hash
+            uniformCells.clear();
+            if (options.mode == HashMode) {
+                for (int i=0; i<oldChunks.size(); ++i) {
+                    if (oldChunks.at(i).flags() & Chunk::Uniform)
+                        uniformCells[oldChunks.at(i).uniformColor()].push_back(i);
+                }
+            }
+            // offsets of more than count - 1 cells are outside of the grid
+            const int radius = qMin(motion.radius(QSize(newImage->width() / count, newImage->height() / count),
+                                                  options),
+                                    count - 1);
+            spiral(radius, offsets);
+            // each new chunk is looked for independently, the results are
+            // collected in newChunks order so they don't depend on --jobs
+            pool.run(newChunks.size(), [&](int i) {
+                const Chunk &newChunk = newChunks.at(i);
+                if (newChunk.isNull() || results[i].isValid())
+                    return;
+                Q_ASSERT(newChunk.width() >= minSize && newChunk.height() >= minSize);
+
+                if (options.mode == HashMode) {
+                    // unmoved content is by far the most common, check it before hashing
+                    const Chunk oldChunk = oldImage->chunk(newChunk.rect());
+                    if (stats)
+                        stats->chunks.fetch_add(1, std::memory_order_relaxed);
+                    if (newChunk.compare(oldChunk, thresholds, stats)) {
+                        results[i] = oldChunk;
+                    } else if (newChunk.flags() & Chunk::Uniform) {
+                        const QHash<QRgb, QVector<int> >::const_iterator it = uniformCells.constFind(newChunk.uniformColor());
+                        if (it == uniformCells.constEnd())
+                            return;
+                        for (int idx : it.value()) {
+                            const QRect cut(oldChunks.at(idx).rect().topLeft(), newChunk.size());
+                            if (oldChunks.at(idx).rect().contains(cut) && bounds.contains(cut)) {
+                                results[i] = oldImage->chunk(cut);
+                                if (stats)
+                                    stats->uniformHits.fetch_add(1, std::memory_order_relaxed);
+                                break;
+                            }
+                        }
+                    }
+                    return;
+                }
+
+                // unmoved first, then where the neighbors came from, then the
+                // cells around it
+                auto candidate = [&](const Chunk &oldChunk, bool predicted) {
+                    if (!bounds.contains(oldChunk.rect()))
+                        return false;
+                    if (stats)
+                        stats->candidates.fetch_add(1, std::memory_order_relaxed);
+                    if (options.verbose >= 2) {
+                        qDebug() << "comparing chunks" << newChunk << oldChunk;
+                    }
+                    if (oldChunk.size() != newChunk.size() || !newChunk.compare(oldChunk, thresholds, stats))
+                        return false;
+                    results[i] = oldChunk;
+                    if (predicted && stats)
+                        stats->predictedHits.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                };
+                if (candidate(oldChunks.at(i), false))
+                    return;
+                QPoint predictions[MotionField::MaxPredictions];
+                const int predictionCount = motion.predict(newChunk.rect(), predictions);
+                for (int p=0; p<predictionCount; ++p) {
+                    const QRect r = newChunk.rect().translated(predictions[p]);
+                    if (bounds.contains(r) && candidate(oldImage->chunk(r), true))
+                        return;
+                }
+                const int x = i % count;
+                const int y = i / count;
+                for (int o=1; o<(2 * radius + 1) * (2 * radius + 1); ++o) {
+                    const int xx = x + offsets.at(o).x();
+                    const int yy = y + offsets.at(o).y();
+                    if (xx < 0 || xx >= count || yy < 0 || yy >= count)
+                        continue;
+                    const Chunk &oldChunk = oldChunks.at((yy * count) + xx);
+                    const QPoint offset = oldChunk.rect().topLeft() - newChunk.rect().topLeft();
+                    bool predicted = false;
+                    for (int p=0; !predicted && p<predictionCount; ++p)
+                        predicted = predictions[p] == offset;
+                    if (!predicted && candidate(oldChunk, false))
+                        return;
+                }
+            });
+            if (options.mode == HashMode)
+                findMoved(oldImage, bounds, newChunks, found, pool, stats);
+        }
+
+        const int levelStart = matches.size();
+        int chunkCount = 0, foundCount = 0;
+        for (int i=0; i<newChunks.size(); ++i) {
+            if (newChunks.at(i).isValid())
+                ++chunkCount;
+            if (found.at(i).isValid()) {
+                used.add(newChunks.at(i).rect());
+                motions[referenceOf(found.at(i), oldImages)].add(newChunks.at(i).rect(), found.at(i).rect());
+                matches.push_back(std::make_pair(newChunks.at(i), found.at(i)));
+                ++foundCount;
+            }
+        }
+        if (stats) {
+            const Stats::Level level = { count, timer.nsecsElapsed(), chunkCount, foundCount };
+            stats->levels.push_back(level);
+            stats->chunks.fetch_add(chunkCount + oldChunkCount, std::memory_order_relaxed);
+        }
+        report(provisional, oldImages, matches, levelStart);
+
+        ++count;
+    }
+}
+
+// Searches newImage a band of about options.bandHeight rows at a time, each
+// against the same rows of the old images in grid mode and against a window
+// of --range bands above and below it otherwise. Only the band and the
+// windows get summed-area tables, and mapped rows above them are given back
+// to the kernel as the bands move down, so memory use depends on the band
+// height rather than on the image height. Moves out of the window aren't
+// found.
+static void searchBands(const QVector<std::shared_ptr<Image> > &oldImages, const std::shared_ptr<Image> &newImage,
+                        const Options &options, ThreadPool &pool,
+                        Occupancy &used, QVector<std::pair<Chunk, Chunk> > &matches, Stats *stats,
+                        const MatchCallback &provisional)
+{
+    const int height = newImage->height();
+    const int bandCount = qMax(1, height / options.bandHeight);
+    const int margin = options.mode == GridMode ? 0 : options.range * options.bandHeight;
+    // the matches of the band above predict the moves at the top of the next
+    QVector<std::pair<Chunk, Chunk> > previous;
+    for (int b=0; b<bandCount; ++b) {
+        const int y = (height * b) / bandCount;
+        const int bottom = (height * (b + 1)) / bandCount;
+        const int windowTop = qMax(0, y - margin);
+        const int windowBottom = qMin(height, bottom + margin);
+        QVector<std::shared_ptr<Image> > windows;
+        for (const std::shared_ptr<Image> &oldImage : oldImages)
+            windows.push_back(oldImage->band(windowTop, windowBottom - windowTop));
+        QVector<std::pair<Chunk, Chunk> > bandMatches;
+        searchImage(windows, newImage->band(y, bottom - y), options, pool, used, bandMatches, stats, provisional,
+                    previous);
+        // the matches outlive the bands and their tables
+        previous.resize(0);
+        for (const auto &match : bandMatches) {
+            const Image *oldImage = oldImages.at(referenceOf(match.second, oldImages)).get();
+            previous.push_back(std::make_pair(match.first.rebased(newImage.get()), match.second.rebased(oldImage)));
+        }
+        matches += previous;
+        newImage->discardRows(bottom);
+        for (const std::shared_ptr<Image> &oldImage : oldImages)
+            oldImage->discardRows(bottom - margin);
+    }
+}
+
+void search(const std::shared_ptr<Image> &oldImage, const std::shared_ptr<Image> &newImage,
+            const Options &options, ThreadPool &pool,
+            Occupancy &used, QVector<std::pair<Chunk, Chunk> > &matches, Stats *stats,
+            const MatchCallback &provisional)
+{
+    search(QVector<std::shared_ptr<Image> >() << oldImage, newImage, options, pool, used, matches, stats, provisional);
+}
+
+void search(const QVector<std::shared_ptr<Image> > &oldImages, const std::shared_ptr<Image> &newImage,
+            const Options &options, ThreadPool &pool,
+            Occupancy &used, QVector<std::pair<Chunk, Chunk> > &matches, Stats *stats,
+            const MatchCallback &provisional)
+{
+    if (options.hasDamage) {
+        // whatever wasn't damaged is the same as in the first old image and
+        // isn't searched
+        const int from = matches.size();
+        Occupancy damaged(newImage->size());
+        for (const QRect &rect : options.damage)
+            damaged.add(rect.intersected(newImage->rect()));
+        for (const QRect &rect : damaged.uncovered()) {
+            used.add(rect);
+            matches.push_back(std::make_pair(newImage->chunk(rect), oldImages.first()->chunk(rect)));
+        }
+        report(provisional, oldImages, matches, from);
+    }
+    if (options.bandHeight)
+        searchBands(oldImages, newImage, options, pool, used, matches, stats, provisional);
+    else
+        searchImage(oldImages, newImage, options, pool, used, matches, stats, provisional);
+}
+
+Stats::Stats()
+    : chunks(0), comparisons(0), pixelsCompared(0), probeRejects(0), sumsRejects(0), earlyExits(0), uniformHits(0), candidates(0), predictedHits(0), scrollRects(0), joins(0), changedRects(0)
+{
+    for (int i=0; i<PhaseCount; ++i)
+        nsecs[i] = 0;
+}
+
+void Stats::write(StatsFormat format, const QString &fileName, FILE *err) const
+{
+    FILE *f = err;
+    if (!fileName.isEmpty()) {
+        f = fopen(fileName.toLocal8Bit().constData(), "a");
+        if (!f) {
+            fprintf(err, "Failed to open %s for writing stats\n", qPrintable(fileName));
+            return;
+        }
+    }
+    static const char *const phases[] = { "decode", "search", "join", "uncovered", "output" };
+    const quint64 counters[] = { chunks, comparisons, pixelsCompared, probeRejects, sumsRejects, earlyExits, uniformHits,
+                                 candidates, predictedHits,
+                                 quint64(scrollRects), quint64(joins), quint64(changedRects) };
+    static const char *const counterNames[] = { "chunks", "comparisons", "pixels-compared", "probe-rejects", "sums-rejects",
+                                                "early-exits", "uniform-hits", "candidates", "predicted-hits",
+                                                "scroll-rects", "joins", "changed-rects" };
+    const int counterCount = sizeof(counters) / sizeof(counters[0]);
+    if (format == JsonStats) {
+        // one object per line so sequences can append to the same file
+        fprintf(f, "{\"phases\":{");
+        for (int i=0; i<PhaseCount; ++i)
+            fprintf(f, "%s\"%s\":%.3f", i ? "," : "", phases[i], nsecs[i] / 1000000.);
+        fprintf(f, "},\"levels\":[");
+        for (int i=0; i<levels.size(); ++i) {
+            const Level &level = levels.at(i);
+            fprintf(f, "%s{\"count\":%d,\"ms\":%.3f,\"chunks\":%d,\"found\":%d}", i ? "," : "",
+                    level.count, level.nsecs / 1000000., level.chunks, level.found);
+        }
+        fprintf(f, "],\"counters\":{");
+        for (int i=0; i<counterCount; ++i)
+            fprintf(f, "%s\"%s\":%llu", i ? "," : "", counterNames[i], static_cast<unsigned long long>(counters[i]));
+        fprintf(f, "}}\n");
+    } else {
+        fprintf(f, "stats:");
+        for (int i=0; i<PhaseCount; ++i)
+            fprintf(f, " %s %.3fms", phases[i], nsecs[i] / 1000000.);
+        fprintf(f, "\n");
+        for (const Level &level : levels) {
+            fprintf(f, "stats: level %d %.3fms chunks %d found %d\n",
+                    level.count, level.nsecs / 1000000., level.chunks, level.found);
+        }
+        fprintf(f, "stats:");
+        for (int i=0; i<counterCount; ++i)
+            fprintf(f, " %s %llu", counterNames[i], static_cast<unsigned long long>(counters[i]));
+        fprintf(f, "\n");
+    }
+    if (f != err)
+        fclose(f);
+}
+
+bool diffImages(const std::shared_ptr<Image> &oldImage, const std::shared_ptr<Image> &newImage,
+                const Options &options, ThreadPool &pool, Result &result, QString *error, Stats *stats,
+                const MatchCallback &provisional)
+{
+    return diffImages(QVector<std::shared_ptr<Image> >() << oldImage, newImage, options, pool,
+                      result, error, stats, provisional);
+}
+
+bool diffImages(const QVector<std::shared_ptr<Image> > &oldImages, const std::shared_ptr<Image> &newImage,
+                const Options &options, ThreadPool &pool, Result &result, QString *error, Stats *stats,
+                const MatchCallback &provisional)
+{
+    auto fail = [error](const QString &message) {
+        if (error)
+            *error = message;
+        return false;
+    };
+    if (options.mode == HashMode && !Thresholds(options.threshold).isExact())
+        return fail("--mode=hash only finds exact matches, it can't be used with --threshold");
+
+    if (options.bandHeight && options.bandHeight < options.minSize)
+        return fail("--band-height can't be less than --min-size");
+
+    if (oldImages.isEmpty())
+        return fail("No reference images");
+
+    for (const std::shared_ptr<Image> &oldImage : oldImages) {
+        if (oldImage->size() != newImage->size()) {
+            char buf[1024];
+            snprintf(buf, sizeof(buf), "Images have different sizes: %dx%d vs %dx%d",
+                     oldImage->width(), oldImage->height(),
+                     newImage->width(), newImage->height());
+            return fail(QString::fromLocal8Bit(buf));
+        }
+    }
+
+    QElapsedTimer timer;
+    QVector<std::pair<Chunk, Chunk> > matches;
+    Occupancy used(newImage->size());
+    if (stats)
+        timer.start();
+    search(oldImages, newImage, options, pool, used, matches, stats, provisional);
+    if (stats)
+        stats->nsecs[Stats::SearchPhase] = timer.nsecsElapsed();
+    if (!matches.isEmpty() && !options.nojoin) {
+        const int count = matches.size();
+        if (stats)
+            timer.start();
+        joinChunks(matches, options.verbose);
+        if (stats) {
+            stats->nsecs[Stats::JoinPhase] = timer.nsecsElapsed();
+            stats->joins = count - matches.size();
+        }
+    }
+
+    result.matches.resize(matches.size());
+    for (int i=0; i<matches.size(); ++i) {
+        Match &match = result.matches[i];
+        match.oldRect = matches.at(i).second.rect();
+        match.newRect = matches.at(i).first.rect();
+        match.transparent = matches.at(i).first.flags() & Chunk::AllTransparent;
+        match.reference = referenceOf(matches.at(i).second, oldImages);
+    }
+    if (result.matches.isEmpty()) {
+        result.changed = QVector<QRect>() << newImage->rect();
+        if (stats)
+            stats->changedRects = 1;
+        return true;
+    }
+    if (stats)
+        timer.start();
+    result.changed = used.uncovered();
+    if (stats) {
+        stats->nsecs[Stats::UncoveredPhase] = timer.nsecsElapsed();
+        stats->changedRects = result.changed.size();
+    }
+    return true;
+}
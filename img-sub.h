@@ -0,0 +1,738 @@
+#ifndef IMG_SUB_H
+#define IMG_SUB_H
+
+#include <QtGui>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// The squared integer distances the pixel comparisons allow for a
+// --threshold, derived for each search so searches with different
+// thresholds can run side by side
+struct Thresholds
+{
+    explicit Thresholds(float threshold = 0);
+    bool isExact() const { return !squared && !alpha; }
+
+    int squared, alpha;
+};
+
+struct Color
+{
+    Color(const QColor &col = QColor())
+        : red(col.red()), green(col.green()), blue(col.blue()), alpha(col.alpha())
+    {}
+    Color(QRgb rgba)
+        : red(qRed(rgba)), green(qGreen(rgba)), blue(qBlue(rgba)), alpha(qAlpha(rgba))
+    {}
+
+    QString toString() const
+    {
+        char buf[1024];
+        snprintf(buf, sizeof(buf), "%02x%02x%02x%02x", red, green, blue, alpha);
+        return QString::fromLocal8Bit(buf);
+    }
+
+    QRgb rgba() const { return qRgba(red, green, blue, alpha); }
+
+    bool compare(const Color &other, const Thresholds &thresholds = Thresholds()) const;
+
+    bool operator==(const Color &other) const
+    {
+        return compare(other);
+    }
+    bool operator!=(const Color &other) const
+    {
+        return !compare(other);
+    }
+
+
+    quint8 red, green, blue, alpha;
+};
+
+// Channel sums over a rect, looked up in an Image's summed-area table.
+// squares is the sum of r*r + g*g + b*b + a*a.
+struct Sums
+{
+    quint32 red, green, blue, alpha;
+    quint64 squares;
+};
+
+// The parts of an image that have been matched, one bit per pixel. Much
+// cheaper than a QRegion once the matches are fragmented into thousands of
+// rects.
+class Occupancy
+{
+public:
+    Occupancy(const QSize &size = QSize(0, 0))
+        : mWidth(size.width()), mHeight(size.height()), mWordsPerLine((mWidth + 63) / 64),
+          mBits(mWordsPerLine * mHeight, 0), mEmpty(true)
+    {}
+
+    bool isEmpty() const { return mEmpty; }
+
+    void add(const QRect &rect)
+    {
+        if (rect.isEmpty())
+            return;
+        mEmpty = false;
+        for (int y=rect.top(); y<=rect.bottom(); ++y) {
+            quint64 *line = mBits.data() + (y * mWordsPerLine);
+            forEachWord(rect, [line](int word, quint64 mask) { line[word] |= mask; });
+        }
+    }
+
+    bool intersects(const QRect &rect) const
+    {
+        if (mEmpty)
+            return false;
+        for (int y=rect.top(); y<=rect.bottom(); ++y) {
+            const quint64 *line = mBits.constData() + (y * mWordsPerLine);
+            bool hit = false;
+            forEachWord(rect, [line, &hit](int word, quint64 mask) { hit = hit || (line[word] & mask); });
+            if (hit)
+                return true;
+        }
+        return false;
+    }
+
+    bool contains(const QRect &rect) const
+    {
+        if (mEmpty)
+            return false;
+        for (int y=rect.top(); y<=rect.bottom(); ++y) {
+            const quint64 *line = mBits.constData() + (y * mWordsPerLine);
+            bool miss = false;
+            forEachWord(rect, [line, &miss](int word, quint64 mask) { miss = miss || (~line[word] & mask); });
+            if (miss)
+                return false;
+        }
+        return true;
+    }
+
+    // The pixels that aren't covered as the same y-x banded rects that
+    // QRegion::rects() would return: each band of rows with identical runs
+    // becomes one rect per run.
+    QVector<QRect> uncovered() const
+    {
+        QVector<QRect> ret;
+        QVector<std::pair<int, int> > band, runs;
+        int bandStart = 0;
+        for (int y=0; y<=mHeight; ++y) {
+            runs.clear();
+            if (y < mHeight) {
+                const quint64 *line = mBits.constData() + (y * mWordsPerLine);
+                int x = 0;
+                while (x < mWidth) {
+                    const int start = find(line, x, false);
+                    if (start == mWidth)
+                        break;
+                    x = find(line, start, true);
+                    runs.push_back(std::make_pair(start, x));
+                }
+            }
+            if (y && runs == band)
+                continue;
+            for (const std::pair<int, int> &run : band)
+                ret.push_back(QRect(run.first, bandStart, run.second - run.first, y - bandStart));
+            band = runs;
+            bandStart = y;
+        }
+        return ret;
+    }
+private:
+    // calls function with the word index and mask of the bits of each word
+    // in a row that rect covers
+    template <typename Function>
+    static void forEachWord(const QRect &rect, Function function)
+    {
+        const int first = rect.left() / 64;
+        const int last = rect.right() / 64;
+        for (int word=first; word<=last; ++word) {
+            quint64 mask = ~0ull;
+            if (word == first)
+                mask &= ~0ull << (rect.left() % 64);
+            if (word == last && rect.right() % 64 != 63)
+                mask &= (1ull << ((rect.right() % 64) + 1)) - 1;
+            function(word, mask);
+        }
+    }
+
+    // first x >= from whose bit is set, mWidth if there is none
+    int find(const quint64 *line, int from, bool set) const
+    {
+        int word = from / 64;
+        if (word >= mWordsPerLine)
+            return mWidth;
+        quint64 bits = (set ? line[word] : ~line[word]) & (~0ull << (from % 64));
+        while (!bits) {
+            if (++word == mWordsPerLine)
+                return mWidth;
+            bits = set ? line[word] : ~line[word];
+        }
+        return qMin(mWidth, (word * 64) + __builtin_ctzll(bits));
+    }
+
+    int mWidth, mHeight, mWordsPerLine;
+    QVector<quint64> mBits;
+    bool mEmpty;
+};
+
+enum StatsFormat {
+    NoStats,
+    TextStats,
+    JsonStats
+};
+
+// Wall times and work counters of one diff, only collected with --stats.
+// The counters are updated from the search threads.
+struct Stats
+{
+    enum Phase {
+        DecodePhase,
+        SearchPhase,
+        JoinPhase,
+        UncoveredPhase,
+        OutputPhase,
+        PhaseCount
+    };
+
+    // one per chunk count of the grid and hash modes or depth of the quadtree
+    struct Level
+    {
+        int count;
+        qint64 nsecs;
+        int chunks, found;
+    };
+
+    Stats();
+    // Appends the stats to fileName, or writes them to err if it's empty
+    void write(StatsFormat format, const QString &fileName, FILE *err) const;
+
+    qint64 nsecs[PhaseCount];
+    QVector<Level> levels;
+    std::atomic<quint64> chunks, comparisons, pixelsCompared, probeRejects, sumsRejects, earlyExits, uniformHits;
+    std::atomic<quint64> candidates, predictedHits;
+    int scrollRects, joins, changedRects;
+};
+
+class Image;
+struct QuadNode;
+// A rect of an image. Chunks don't keep their image alive, whoever
+// searches has to hold on to the images for as long as the chunks are used.
+class Chunk
+{
+public:
+    Chunk(const Image *i = 0, const QRect &r = QRect());
+    int x() const { return mRect.x(); }
+    int y() const { return mRect.y(); }
+    int height() const { return mRect.height(); }
+    int width() const { return mRect.width(); }
+    QSize size() const { return mRect.size(); }
+    QRect rect() const { return mRect; }
+
+    inline Color color(int x, int y) const;
+    bool compare(const Chunk &other, const Thresholds &thresholds = Thresholds(), Stats *stats = 0) const;
+    bool operator==(const Chunk &other) const { return compare(other); }
+    bool operator!=(const Chunk &other) const { return !compare(other); }
+    const Image *image() const { return mImage; }
+    bool isNull() const { return !mImage; }
+    bool isValid() const { return mImage; }
+    void adopt(const Chunk &other);
+    // The same rect in image, which has to be a band() of this chunk's
+    // image or the other way around
+    Chunk rebased(const Image *image) const
+    {
+        Chunk ret(*this);
+        ret.mImage = image;
+        return ret;
+    }
+    Qt::Alignment isAligned(const Chunk &other) const;
+    enum Flag {
+        None = 0x0,
+        AllTransparent = 0x1,
+        Uniform = 0x2 // all pixels are uniformColor()
+    };
+
+    quint32 flags() const { return mFlags; }
+    QRgb uniformColor() const { return mColor; }
+    void save(const QString &fileName) const;
+
+    // the pixels at the corners, the middle of the edges and the center,
+    // compared before anything else
+    enum { ProbeCount = 9 };
+    const QRgb *probes() const { return mProbes; }
+private:
+    const Image *mImage;
+    QRect mRect;
+    quint32 mFlags;
+    QRgb mColor;
+    // with red and blue in QRgb order whether the image is swapped or not
+    QRgb mProbes[ProbeCount];
+};
+
+class Image : public std::enable_shared_from_this<Image>
+{
+public:
+    ~Image()
+    {
+        if (mMapped)
+            munmap(mMapped, mMappedSize);
+    }
+
+    // rawSize is the size of raw .bgra files, which don't have one of their
+    // own. With a cacheDir the decoded pixels and the summed-area table are
+    // mapped from a file there if one was written for this version of
+    // fileName, and written there for next time if not
+    static std::shared_ptr<Image> load(const QString &fileName, const QSize &rawSize = QSize(),
+                                       const QString &cacheDir = QString());
+
+    // Identifies this version of fileName as load() would decode it: the
+    // file's size and modification time and rawSize. Empty if fileName
+    // can't be stat'ed.
+    static QByteArray versionKey(const QString &fileName, const QSize &rawSize);
+
+    enum PixelFormat {
+        ARGB32, // 0xAARRGGBB words, what QImage::Format_ARGB32 uses
+        RGBA8888 // r, g, b, a bytes
+    };
+
+    // Wraps pixels the caller owns without copying them, bits has to stay
+    // valid and unchanged for as long as the image is used. Returns a null
+    // pointer if the size or bytesPerLine don't describe a valid buffer.
+    static std::shared_ptr<Image> fromBuffer(const uchar *bits, int width, int height, int bytesPerLine,
+                                             PixelFormat format, const QString &name = QString());
+
+    static std::shared_ptr<Image> fromImage(QImage image, const QString &name)
+    {
+        if (image.format() != QImage::Format_ARGB32)
+            image = image.convertToFormat(QImage::Format_ARGB32);
+
+        std::shared_ptr<Image> ret(new Image);
+        ret->mFileName = name;
+        ret->mSize = image.size();
+        ret->mImage = image;
+        ret->mBits = image.constBits();
+        ret->mBytesPerLine = image.bytesPerLine();
+        return ret;
+    }
+
+    // The rows [y, y + height) of this image without copying them. The band
+    // keeps the coordinates of this image so its rect() starts at y. It uses
+    // the image's summed-area table if there is one and builds its own in
+    // buildSums() otherwise.
+    std::shared_ptr<Image> band(int y, int height) const
+    {
+        Q_ASSERT(y >= mTop && height > 0 && y + height <= mTop + mSize.height());
+        std::shared_ptr<Image> ret(new Image);
+        ret->mParent = mParent ? mParent : shared_from_this();
+        ret->mFileName = mFileName;
+        ret->mSize = QSize(width(), height);
+        ret->mTop = y;
+        ret->mBits = mBits + (size_t(y - mTop) * mBytesPerLine);
+        ret->mBytesPerLine = mBytesPerLine;
+        ret->mSwapped = mSwapped;
+        // differences of the parent's table are the same as the band's own
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mSumsTable)
+            ret->mSumsTable = mSumsTable + (size_t(y - mTop) * (width() + 1));
+        return ret;
+    }
+
+    // The image that owns the pixels, this one unless it's a band()
+    const Image *source() const { return mParent ? mParent.get() : this; }
+
+    // Builds the summed-area table that sums() and Chunk need unless it's
+    // already there. search() calls it so images that are only searched in
+    // bands never get a table for all of their pixels. Searches on other
+    // threads that call it for the same image wait for the first one.
+    void buildSums();
+
+    // Lets the kernel drop mapped rows above y, they're read from the file
+    // again if they're needed after all
+    void discardRows(int y) const
+    {
+        if (y <= mTop || (!mMapped && !(mParent && mParent->mMapped)))
+            return;
+        const long pageSize = sysconf(_SC_PAGESIZE);
+        const quintptr begin = (reinterpret_cast<quintptr>(mBits) + pageSize - 1) & ~quintptr(pageSize - 1);
+        const quintptr end = reinterpret_cast<quintptr>(mBits + (size_t(y - mTop) * mBytesPerLine)) & ~quintptr(pageSize - 1);
+        if (end > begin)
+            madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+    }
+
+    Chunk chunk(const QRect &rect) const { return Chunk(this, rect); }
+
+    // The cells of a count x count grid, the ones that intersect filter are
+    // null. ret is reused so a search doesn't allocate at every level.
+    // Returns false if the cells would be smaller than minSize.
+    bool chunks(int count, int minSize, QVector<Chunk> &ret, const Occupancy *filter = 0) const
+    {
+        if (count == 1) {
+            ret.fill(Chunk(), 1);
+            if (!filter || !filter->intersects(rect()))
+                ret[0] = chunk(rect());
+            return true;
+        }
+        Q_ASSERT(count > 1);
+        const int w = width() / count;
+        const int wextra = width() - (w * count);
+        const int h = height() / count;
+        if (w < minSize || h < minSize)
+            return false;
+        const int hextra = height() - (h * count);
+        ret.fill(Chunk(), count * count);
+        for (int y=0; y<count; ++y) {
+            for (int x=0; x<count; ++x) {
+                const QRect r(x * w,
+                              mTop + (y * h),
+                              w + (x + 1 == count ? wextra : 0),
+                              h + (y + 1 == count ? hextra : 0));
+                // const QRect r(x * w, y * h, w, h);
+                if (!filter || !filter->intersects(r)) {
+                    ret[(y * count) + x] = chunk(r);
+                }
+            }
+        }
+        return true;
+    }
+
+    Color color(int x, int y) const
+    {
+        Q_ASSERT(x >= 0);
+        Q_ASSERT(x < mSize.width());
+        return pixel(scanLine(y)[x]);
+    }
+
+    // Pixels in ARGB32 byte order (QRgb), or RGBA byte order when
+    // isSwapped(). The rgb distance doesn't care about the order of red
+    // and blue so only compares between swapped and unswapped images need
+    // to convert.
+    const quint32 *scanLine(int y) const
+    {
+        Q_ASSERT(y >= mTop);
+        Q_ASSERT(y < mTop + mSize.height());
+        return reinterpret_cast<const quint32 *>(mBits + (size_t(y - mTop) * mBytesPerLine));
+    }
+    bool isSwapped() const { return mSwapped; }
+
+    // Constant time sums of the pixels in rect. Returns false when there's
+    // no table yet or the rect is so large that the 32-bit channel sums
+    // could overflow.
+    bool sums(const QRect &rect, Sums *sums) const
+    {
+        if (!mSumsTable || quint64(rect.width()) * rect.height() * 255 > 0xffffffffull)
+            return false;
+        const int stride = width() + 1;
+        const int top = rect.y() - mTop;
+        const int bottom = rect.bottom() + 1 - mTop;
+        const Sums &topLeft = mSumsTable[(top * stride) + rect.x()];
+        const Sums &topRight = mSumsTable[(top * stride) + rect.right() + 1];
+        const Sums &bottomLeft = mSumsTable[(bottom * stride) + rect.x()];
+        const Sums &bottomRight = mSumsTable[(bottom * stride) + rect.right() + 1];
+        // the tables wrap around but the result is exact as long as it fits
+        sums->red = bottomRight.red - topRight.red - bottomLeft.red + topLeft.red;
+        sums->green = bottomRight.green - topRight.green - bottomLeft.green + topLeft.green;
+        sums->blue = bottomRight.blue - topRight.blue - bottomLeft.blue + topLeft.blue;
+        sums->alpha = bottomRight.alpha - topRight.alpha - bottomLeft.alpha + topLeft.alpha;
+        sums->squares = bottomRight.squares - topRight.squares - bottomLeft.squares + topLeft.squares;
+        if (mSwapped)
+            std::swap(sums->red, sums->blue);
+        return true;
+    }
+    QRgb pixel(quint32 value) const { return mSwapped ? swapRedBlue(value) : value; }
+    static quint32 swapRedBlue(quint32 value)
+    {
+        return (value & 0xff00ff00) | ((value & 0xff) << 16) | ((value >> 16) & 0xff);
+    }
+
+    QSize size() const { return mSize; }
+    int width() const { return mSize.width(); }
+    int height() const { return mSize.height(); }
+    QString fileName() const { return mFileName; }
+    QRect rect() const { return QRect(0, mTop, width(), height()); }
+    QImage image() const
+    {
+        if (!mImage.isNull())
+            return mImage;
+        const QImage ret(mBits, width(), height(), mBytesPerLine, QImage::Format_ARGB32);
+        return mSwapped ? ret.rgbSwapped() : ret.copy();
+    }
+private:
+    Image()
+        : mTop(0), mBits(0), mBytesPerLine(0), mSwapped(false), mMapped(0), mMappedSize(0), mSumsTable(0), mQuadtreeMinSize(0)
+    {}
+
+    static bool loadMapped(const QString &fileName, const QSize &rawSize, std::shared_ptr<Image> &image);
+    static std::shared_ptr<Image> loadCached(const QString &cacheFile, const QString &fileName);
+    bool saveCached(const QString &cacheFile) const;
+
+    friend QVector<quint64> quadtreeHashes(const Image &image, const QRect &rect, int minSize,
+                                           const QVector<QuadNode> &nodes);
+
+    QString mFileName;
+    QImage mImage;
+    // the image a band() was made from, it owns the pixels
+    std::shared_ptr<const Image> mParent;
+    QSize mSize;
+    int mTop;
+    const uchar *mBits;
+    int mBytesPerLine;
+    bool mSwapped;
+    void *mMapped;
+    size_t mMappedSize;
+    // (width + 1) * (height + 1) summed-area table, first row and column are
+    // 0. Points to mSums or into a mapped cache file.
+    QVector<Sums> mSums;
+    const Sums *mSumsTable;
+    // hashQuadtree() of the last quadtree this image was searched with
+    mutable QVector<quint64> mQuadtreeHashes;
+    mutable QRect mQuadtreeRect;
+    mutable int mQuadtreeMinSize;
+    // guards the table and hashes that are built when they're first needed,
+    // so an image can be searched by several diffs at once
+    mutable std::mutex mMutex;
+};
+
+// Runs parallel loops on threads that are started once. Each thread works
+// through its own share of the indexes from the front and when it runs out
+// steals half of what's left of another thread's share from the back.
+class ThreadPool
+{
+public:
+    ThreadPool(int threads)
+        : mRanges(threads), mFunction(0), mGeneration(0), mActive(0), mStop(false)
+    {
+        // the thread calling run() is worker 0
+        for (int i=1; i<threads; ++i)
+            mThreads.push_back(std::thread(&ThreadPool::loop, this, i));
+    }
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mCondition.notify_all();
+        for (std::thread &thread : mThreads)
+            thread.join();
+    }
+
+    int count() const { return mRanges.size(); }
+
+    // Calls function for every index in [0, count) and returns when all calls are done
+    void run(int count, const std::function<void(int)> &function)
+    {
+        const int threads = mRanges.size();
+        if (threads == 1 || count <= 1) {
+            for (int i=0; i<count; ++i)
+                function(i);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            for (int i=0; i<threads; ++i) {
+                std::lock_guard<std::mutex> rangeLock(mRanges[i].mutex);
+                mRanges[i].begin = (count * i) / threads;
+                mRanges[i].end = (count * (i + 1)) / threads;
+            }
+            mFunction = &function;
+            mActive = threads - 1;
+            ++mGeneration;
+        }
+        mCondition.notify_all();
+        work(0);
+        std::unique_lock<std::mutex> lock(mMutex);
+        mDone.wait(lock, [this]() { return !mActive; });
+        mFunction = 0;
+    }
+private:
+    void loop(int worker)
+    {
+        int generation = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [&]() { return mStop || mGeneration != generation; });
+                if (mStop)
+                    return;
+                generation = mGeneration;
+            }
+            work(worker);
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (!--mActive)
+                mDone.notify_one();
+        }
+    }
+
+    void work(int worker)
+    {
+        const std::function<void(int)> &function = *mFunction;
+        Range &own = mRanges[worker];
+        while (true) {
+            int index = -1;
+            {
+                std::lock_guard<std::mutex> lock(own.mutex);
+                if (own.begin < own.end)
+                    index = own.begin++;
+            }
+            if (index == -1 && !steal(worker))
+                return;
+            if (index != -1)
+                function(index);
+        }
+    }
+
+    bool steal(int worker)
+    {
+        const int threads = mRanges.size();
+        for (int i=1; i<threads; ++i) {
+            Range &victim = mRanges[(worker + i) % threads];
+            int begin, end;
+            {
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                const int remaining = victim.end - victim.begin;
+                if (remaining <= 0)
+                    continue;
+                end = victim.end;
+                victim.end -= (remaining + 1) / 2;
+                begin = victim.end;
+            }
+            Range &own = mRanges[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            own.begin = begin;
+            own.end = end;
+            return true;
+        }
+        return false;
+    }
+
+    struct Range {
+        Range() : begin(0), end(0) {}
+        std::mutex mutex;
+        int begin, end;
+    };
+    std::vector<Range> mRanges;
+    std::vector<std::thread> mThreads;
+    std::mutex mMutex;
+    std::condition_variable mCondition, mDone;
+    const std::function<void(int)> *mFunction;
+    int mGeneration, mActive;
+    bool mStop;
+};
+
+enum Mode {
+    GridMode,
+    HashMode,
+    QuadtreeMode
+};
+
+enum OutputFormat {
+    TextOutput,
+    JsonLinesOutput,
+    BinaryOutput
+};
+
+enum DumpFormat {
+    PngDump,
+    FastPngDump,
+    PamDump
+};
+
+struct Options
+{
+    Options()
+        : same(false), nojoin(false), dumpImages(false), dumpFormat(PngDump), format(TextOutput), range(2), hasRange(false),
+          mode(GridMode), jobs(1), bandHeight(0), scroll(false), hasDamage(false), stats(NoStats), threshold(0), minSize(10),
+          verbose(0)
+    {}
+
+    bool same;
+    bool nojoin;
+    bool dumpImages;
+    DumpFormat dumpFormat;
+    OutputFormat format;
+    // empty for /tmp/img-sub.png (or .pam)
+    QString dumpPath;
+    int range;
+    // --range was given, the search radius doesn't adapt to the moves found
+    bool hasRange;
+    Mode mode;
+    int jobs;
+    int bandHeight;
+    bool scroll;
+    // only the damage rects can have changed, an empty list means nothing did
+    bool hasDamage;
+    QVector<QRect> damage;
+    QString cacheDir;
+    StatsFormat stats;
+    QString statsFile;
+    float threshold;
+    // smallest chunk side that's searched for
+    int minSize;
+    // qDebug() output, 2 and up for every comparison
+    int verbose;
+};
+
+// Joins adjacent matches that moved by the same offset
+void joinChunks(QVector<std::pair<Chunk, Chunk> > &chunks, int verbose = 0);
+
+struct Match
+{
+    QRect oldRect, newRect;
+    bool transparent;
+    // index of the reference image oldRect is in
+    int reference;
+};
+
+// Gets the matches of each level as soon as the level is done, before
+// they're joined
+typedef std::function<void(const QVector<Match> &matches)> MatchCallback;
+
+// Finds the parts of newImage that are in oldImage, matches are (new, old)
+// pairs and used has the matched parts of newImage
+void search(const std::shared_ptr<Image> &oldImage, const std::shared_ptr<Image> &newImage,
+            const Options &options, ThreadPool &pool,
+            Occupancy &used, QVector<std::pair<Chunk, Chunk> > &matches, Stats *stats = 0,
+            const MatchCallback &provisional = MatchCallback());
+
+// The same with several old images. Each level of the search tries all of
+// them for a chunk before going finer and takes the first one it's found
+// in, the old chunk of a match is in that image.
+void search(const QVector<std::shared_ptr<Image> > &oldImages, const std::shared_ptr<Image> &newImage,
+            const Options &options, ThreadPool &pool,
+            Occupancy &used, QVector<std::pair<Chunk, Chunk> > &matches, Stats *stats = 0,
+            const MatchCallback &provisional = MatchCallback());
+
+struct Result
+{
+    QVector<Match> matches;
+    // the parts of newImage that weren't found in any reference
+    QVector<QRect> changed;
+};
+
+// Compares the images, returns false and sets error if they can't be
+// compared. The images can be used by diffs on other threads at the same
+// time. With stats the time spent and work done is recorded in it, the
+// caller fills in the decode and output times.
+bool diffImages(const std::shared_ptr<Image> &oldImage, const std::shared_ptr<Image> &newImage,
+                const Options &options, ThreadPool &pool, Result &result,
+                QString *error = 0, Stats *stats = 0,
+                const MatchCallback &provisional = MatchCallback());
+
+// Compares newImage against several reference images. A chunk is taken from
+// the first reference it's found in, and all of them are tried for a chunk
+// before it's split up, so a whole chunk in a later reference wins over
+// pieces of it in an earlier one.
+bool diffImages(const QVector<std::shared_ptr<Image> > &oldImages, const std::shared_ptr<Image> &newImage,
+                const Options &options, ThreadPool &pool, Result &result,
+                QString *error = 0, Stats *stats = 0,
+                const MatchCallback &provisional = MatchCallback());
+
+#endif
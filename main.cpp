@@ -1,17 +1,76 @@
-#include <QtGui>
-#include <memory>
+#include "arguments.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <fcntl.h>
-#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
 
-int minSize = 10;
-int verbose = 0;
-float threshold = 0;
-bool imageMagickFormat = false;
+static bool guiApplication = false;
+
+static void usage(FILE *f)
+{
+    fprintf(f,
+            "img-diff [options...] imga imgb\n"
+            "img-diff [options...] references... imgb\n"
+            "  Each chunk is taken from the first reference it's found in, matches are prefixed by\n"
+            "  the index of the reference they came from\n"
+            "img-diff [options...] --sequence images...\n"
+            "  --verbose|-v                       Be verbose\n"
+            "  --range=[range]                    How many cells around a chunk to look for it in,\n"
+            "                                     without it 2 or one more than the moves found so far\n"
+            "  --min-size=[min-size]              The min-size?\n"
+            "  --same                             Only display the areas that are identical\n"
+            "  --no-join                          Don't join chunks\n"
+            "  --format=[text|jsonl|binary]       jsonl and binary stream each level's matches as\n"
+            "                                     provisional records, then write all moved, same and\n"
+            "                                     changed rects and an end record\n"
+            "  --dump-images                      Draw the matches to /tmp/img-sub.png after writing the\n"
+            "                                     results, img-sub closes stdout but doesn't exit until\n"
+            "                                     it's written\n"
+            "  --dump-format=[png|fast-png|pam]   Format of the drawing, fast-png compresses less and\n"
+            "                                     pam not at all\n"
+            "  --dump-path=[file]                 Where to write the drawing\n"
+            "  --imagemagick                      Douchy rects\n"
+            "  --threshold=[threshold]            Set threshold value\n"
+            "  --raw-size=[width]x[height]        Size of raw .bgra images, must precede them\n"
+            "  --mode=[grid|hash|quadtree]        grid only looks for chunks within --range cells,\n"
+            "                                     hash finds exact matches at any offset,\n"
+            "                                     quadtree only splits chunks that weren't found\n"
+            "  --jobs=[jobs]                      Number of threads to search with\n"
+            "  --daemon=[socket]                  Serve requests on a unix socket instead, the other\n"
+            "                                     options are the defaults for all requests\n"
+            "  --cache-size=[count]               Number of decoded images the daemon keeps (8)\n"
+            "  --band-height=[rows]               Search bands of about this many rows at a time to\n"
+            "                                     bound memory use, moves further than --range bands\n"
+            "                                     (or out of the band in grid mode) aren't found\n"
+            "  --scroll                           Look for a scroll by hashing rows and columns first,\n"
+            "                                     only finds exact moves\n"
+            "  --damage=[file|-]                  Only search the rects in file (one per line, as\n"
+            "                                     printed), everything else is reported as the same\n"
+            "  --cache-dir=[dir]                  Keep decoded pixels and summed-area tables of the\n"
+            "                                     images in dir and map them from there next time\n"
+            "  --stats[=text|json]                Write the time spent in each phase and level and\n"
+            "                                     how much work was done to stderr\n"
+            "  --stats-file=[file]                Append the stats to file instead\n"
+            "  --sequence                         Diff each image against the one before it, images\n"
+            "                                     can be directories, wildcards or - to read file names\n"
+            "                                     from stdin. Each diff starts with \"# [old] [new]\"\n"
+            "                                     or a pair record with --format=jsonl or binary\n"
+            "\n"
+            "A request to the daemon is one argument per line, the same arguments as on the\n"
+            "command line, and ends with an empty line. --upload=[name]:[width]x[height]\n"
+            "followed by width * height * 4 bytes of BGRA pixels stores an image that later\n"
+            "requests can refer to as @[name]. --jobs only works on the daemon's command line\n"
+            "and --damage needs a file instead of -. The answer is what img-sub would print\n"
+            "followed by a line with \"exit [code]\" or an exit record with --format=jsonl or\n"
+            "binary.\n");
+}
 
 static inline QByteArray toString(const QRect &rect)
 {
@@ -24,584 +83,724 @@ static inline QByteArray toString(const QRect &rect)
     return buf;
 }
 
-struct Color
+inline bool operator<(const QPoint &l, const QPoint &r)
 {
-    Color(const QColor &col = QColor())
-        : red(col.red()), green(col.green()), blue(col.blue()), alpha(col.alpha())
-    {}
+    if (l.y() < r.y())
+        return true;
+    if (l.y() == r.y())
+        return l.x() < r.x();
+    return false;
+}
 
-    QString toString() const
-    {
-        char buf[1024];
-        snprintf(buf, sizeof(buf), "%02x%02x%02x%02x", red, green, blue, alpha);
-        return QString::fromLocal8Bit(buf);
+static bool writePam(const QImage &image, const QString &fileName)
+{
+    FILE *f = fopen(qPrintable(fileName), "w");
+    if (!f)
+        return false;
+    fprintf(f, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+            image.width(), image.height());
+    QVector<uchar> row(image.width() * 4);
+    bool ok = true;
+    for (int y=0; ok && y<image.height(); ++y) {
+        const QRgb *line = reinterpret_cast<const QRgb *>(image.constScanLine(y));
+        uchar *out = row.data();
+        for (int x=0; x<image.width(); ++x) {
+            *out++ = qRed(line[x]);
+            *out++ = qGreen(line[x]);
+            *out++ = qBlue(line[x]);
+            *out++ = qAlpha(line[x]);
+        }
+        ok = fwrite(row.constData(), row.size(), 1, f) == 1;
     }
+    return !fclose(f) && ok;
+}
 
-    bool compare(const Color &other) const
-    {
-        const float r = powf(red - other.red, 2);
-        const float g = powf(green - other.green, 2);
-        const float b = powf(blue - other.blue, 2);
-
-        float distance = sqrtf(r + g + b);
-        const float alphaDistance = abs(alpha - other.alpha);
-        // if (verbose >= 2) {
-        //     fprintf(stderr, "%s to %s => %f/%f (%f) at %d,%d (%d,%d)\n",
-        //             qPrintable(toString()),
-        //             qPrintable(other.toString()),
-        //             distance,
-        //             alphaDistance,
-        //             threshold,
-        //             needleX, needleY,
-        //             haystackX, haystackY);
-        // }
-        if (alphaDistance > distance)
-            distance = alphaDistance;
-
-        // static float highest = 0;
-        const bool ret = distance <= threshold;
-        // if (verbose >= 1 && ret && distance > highest) {
-        //     fprintf(stderr, "Allowed %f distance for threshold %f at %d,%d (%d,%d) (%s vs %s)\n",
-        //             distance, threshold,
-        //             needleX, needleY,
-        //             haystackX, haystackY,
-        //             qPrintable(needle.toString()),
-        //             qPrintable(haystack.toString()));
-        //     highest = distance;
-        // }
-
-        // need to compare alpha
-        return ret;
-    }
-
-    bool operator==(const Color &other) const
-    {
-        return compare(other);
+// The first reference is drawn underneath, matches from the others are
+// marked in cyan and labeled with their reference even if they didn't move
+static QImage drawDump(const QVector<std::shared_ptr<Image> > &oldImages, const std::shared_ptr<Image> &newImage,
+                       const Result &result)
+{
+    QImage dump = newImage->image();
+    QPainter p(&dump);
+    p.setOpacity(.3);
+    p.drawImage(0, 0, oldImages.first()->image());
+    p.setOpacity(.5);
+    p.setPen(Qt::black);
+    QMap<QPoint, QString> texts;
+    for (const Match &match : result.matches) {
+        if (match.newRect != match.oldRect || match.reference) {
+            p.fillRect(match.newRect, match.reference ? Qt::cyan : Qt::yellow);
+            p.drawRect(match.newRect);
+            QString text = toString(match.oldRect);
+            if (match.reference)
+                text += QString(" in reference %1").arg(match.reference);
+            if (match.newRect != match.oldRect)
+                text += " moved to " + toString(match.newRect);
+            texts[match.newRect.topLeft() + QPoint(2, 10)] = text;
+        }
     }
-    bool operator!=(const Color &other) const
-    {
-        return !compare(other);
+    if (!result.matches.isEmpty()) {
+        for (const QRect &r : result.changed) {
+            p.fillRect(r, Qt::green);
+            p.drawRect(r);
+        }
     }
+    p.setOpacity(1);
+    QFont f;
+    f.setPixelSize(8);
+    p.setFont(f);
+    p.setPen(Qt::blue);
+    // qDebug() << texts;
+    for (QMap<QPoint, QString>::const_iterator it = texts.begin(); it != texts.end(); ++it) {
+        p.drawText(it.key(), it.value());
+    }
+    p.end();
+    return dump;
+}
 
+static void saveDump(const QImage &dump, DumpFormat format, QString fileName)
+{
+    if (fileName.isEmpty())
+        fileName = format == PamDump ? "/tmp/img-sub.pam" : "/tmp/img-sub.png";
+    bool ok;
+    if (format == PamDump) {
+        ok = writePam(dump, fileName);
+    } else {
+        // for png the quality is the inverse of the zlib level, 80 is level 1
+        ok = dump.save(fileName, "PNG", format == FastPngDump ? 80 : -1);
+    }
+    if (!ok)
+        fprintf(stderr, "Failed to write %s\n", qPrintable(fileName));
+}
 
-    quint8 red, green, blue, alpha;
-};
-
-class Image;
-class Chunk
+// Renders --dump-images on a thread of its own after the results have been
+// written. One dump is rendered at a time, the next one waits for it. Where
+// Qt can't draw text outside of the GUI thread the drawing is done before
+// the thread is started and only the encoding is left to it.
+class DumpWriter
 {
 public:
-    Chunk(const std::shared_ptr<const Image> &i = std::shared_ptr<const Image>(), const QRect &r = QRect());
-    Chunk(const Chunk &other)
-        : mImage(other.mImage), mRect(other.mRect), mFlags(other.mFlags)
+    DumpWriter()
+        : mThreadedText(-1)
     {}
-    int x() const { return mRect.x(); }
-    int y() const { return mRect.y(); }
-    int height() const { return mRect.height(); }
-    int width() const { return mRect.width(); }
-    QSize size() const { return mRect.size(); }
-    QRect rect() const { return mRect; }
-
-    inline Color color(int x, int y) const;
-    bool compare(const Chunk &other) const;
-    bool operator==(const Chunk &other) const { return compare(other); }
-    bool operator!=(const Chunk &other) const { return !compare(other); }
-    std::shared_ptr<const Image> image() const { return mImage; }
-    bool isNull() const { return !mImage; }
-    bool isValid() const { return mImage.get(); }
-    void adopt(const Chunk &other);
-    Qt::Alignment isAligned(const Chunk &other) const;
-    enum Flag {
-        None = 0x0,
-        AllTransparent = 0x1
-    };
 
-    quint32 flags() const { return mFlags; }
-    void save(const QString &fileName) const;
-private:
-    std::shared_ptr<const Image> mImage;
-    QRect mRect;
-    quint32 mFlags;
-};
-
-class Image : public std::enable_shared_from_this<Image>
-{
-public:
-    static std::shared_ptr<Image> load(const QString &fileName)
+    ~DumpWriter()
     {
-        QImage image(fileName);
-        if (image.isNull())
-            return std::shared_ptr<Image>();
-
-        const int w = image.width();
-        const int h = image.height();
-        std::shared_ptr<Image> ret(new Image);
-        ret->mFileName = fileName;
-        ret->mSize = image.size();
-        ret->mImage = image;
-        ret->mColors.resize(w * h);
-        for (int y=0; y<h; ++y) {
-            for (int x=0; x<w; ++x) {
-                ret->mColors[x + (y * w)] = QColor::fromRgba(image.pixel(x, y));
-            }
-        }
-        return ret;
+        wait();
     }
 
-    Chunk chunk(const QRect &rect) const { return Chunk(shared_from_this(), rect); }
-
-    QVector<Chunk> chunks(int count, const QRegion &filter = QRegion()) const
+    void write(const QVector<std::shared_ptr<Image> > &oldImages, const std::shared_ptr<Image> &newImage,
+               const Result &result, const Options &options)
     {
-        if (count == 1) {
-            Q_ASSERT(filter.isEmpty());
-            QVector<Chunk> ret;
-            ret.push_back(chunk(rect()));
-            return ret;
+        wait();
+        const DumpFormat format = options.dumpFormat;
+        const QString fileName = options.dumpPath;
+        if (mThreadedText == -1)
+            mThreadedText = QFontDatabase::supportsThreadedFontRendering();
+        if (!mThreadedText) {
+            const QImage dump = drawDump(oldImages, newImage, result);
+            mThread = std::thread([dump, format, fileName]() { saveDump(dump, format, fileName); });
+            return;
         }
-        Q_ASSERT(count > 1);
-        const int w = width() / count;
-        const int wextra = width() - (w * count);
-        const int h = height() / count;
-        if (w < minSize || h < minSize)
-            return QVector<Chunk>();
-        const int hextra = height() - (h * count);
-        QVector<Chunk> ret(count * count);
-        for (int y=0; y<count; ++y) {
-            for (int x=0; x<count; ++x) {
-                const QRect r(x * w,
-                              y * h,
-                              w + (x + 1 == count ? wextra : 0),
-                              h + (y + 1 == count ? hextra : 0));
-                // const QRect r(x * w, y * h, w, h);
-                if (!filter.intersects(r)) {
-                    ret[(y * count) + x] = chunk(r);
-                }
-            }
-        }
-        return ret;
+        mThread = std::thread([oldImages, newImage, result, format, fileName]() {
+            saveDump(drawDump(oldImages, newImage, result), format, fileName);
+        });
     }
 
-    Color color(int x, int y) const
+    void wait()
     {
-        Q_ASSERT(x >= 0);
-        Q_ASSERT(y >= 0);
-        Q_ASSERT(x < mSize.width());
-        Q_ASSERT(y < mSize.height());
-        return mColors.at((y * mSize.width()) + x);
-    }
-
-    QSize size() const { return mSize; }
-    int width() const { return mSize.width(); }
-    int height() const { return mSize.height(); }
-    QString fileName() const { return mFileName; }
-    QRect rect() const { return QRect(0, 0, width(), height()); }
-    QImage image() const { return mImage; }
+        if (mThread.joinable())
+            mThread.join();
+    }
 private:
-    Image()
-    {}
+    std::thread mThread;
+    // QFontDatabase::supportsThreadedFontRendering(), -1 until it's asked
+    int mThreadedText;
+};
 
-    QString mFileName;
-    QImage mImage;
-    QSize mSize;
-    QVector<Color> mColors;
+static DumpWriter dumps;
+
+// One result in --format=jsonl or binary. type is provisional, moved,
+// same, changed or end (writePair() and writeExit() write the pair and exit
+// records), binary records start with its first letter and a flags byte (1
+// for transparent, the reference index shifted left by one) followed by the
+// old rect (for provisional and moved) and the rect as little endian 32 bit
+// x, y, width and height. reference is -1 unless there are several
+// reference images.
+static void writeRecord(FILE *out, OutputFormat format, const char *type,
+                        const QRect *oldRect, const QRect *rect, bool transparent = false,
+                        int reference = -1)
+{
+    if (format == JsonLinesOutput) {
+        fprintf(out, "{\"type\":\"%s\"", type);
+        if (oldRect) {
+            fprintf(out, ",\"old\":[%d,%d,%d,%d]", oldRect->x(), oldRect->y(), oldRect->width(), oldRect->height());
+        }
+        if (rect) {
+            fprintf(out, ",\"%s\":[%d,%d,%d,%d]", oldRect ? "new" : "rect",
+                    rect->x(), rect->y(), rect->width(), rect->height());
+        }
+        if (reference >= 0)
+            fprintf(out, ",\"reference\":%d", reference);
+        fprintf(out, "%s}\n", transparent ? ",\"transparent\":true" : "");
+        return;
+    }
+    uchar record[2 + (8 * 4)];
+    int size = 0;
+    record[size++] = type[0];
+    record[size++] = transparent | (qMax(reference, 0) << 1);
+    auto add = [&](const QRect &r) {
+        const qint32 values[] = { r.x(), r.y(), r.width(), r.height() };
+        for (qint32 value : values) {
+            for (int shift=0; shift<32; shift += 8)
+                record[size++] = quint32(value) >> shift;
+        }
+    };
+    if (oldRect)
+        add(*oldRect);
+    if (rect)
+        add(*rect);
+    fwrite(record, size, 1, out);
+}
 
-};
+static void writeLittleEndian(FILE *out, quint32 value)
+{
+    const uchar bytes[] = { uchar(value), uchar(value >> 8), uchar(value >> 16), uchar(value >> 24) };
+    fwrite(bytes, sizeof(bytes), 1, out);
+}
 
-QDebug &operator<<(QDebug &debug, const Chunk &chunk)
+static QByteArray jsonString(const QString &str)
 {
-    debug << "Chunk(" << chunk.image()->fileName() << chunk.rect() << ")";
-    return debug;
+    const QByteArray utf8 = str.toUtf8();
+    QByteArray ret = "\"";
+    for (int i=0; i<utf8.size(); ++i) {
+        const uchar c = utf8.at(i);
+        if (c == '"' || c == '\\') {
+            ret += '\\';
+            ret += c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            ret += escaped;
+        } else {
+            ret += c;
+        }
+    }
+    ret += '"';
+    return ret;
 }
 
-Chunk::Chunk(const std::shared_ptr<const Image> &i, const QRect &r)
-    : mImage(i), mRect(r), mFlags(0)
+// Starts each diff of --sequence. A line with "# [old] [new]" in text, a
+// pair record in jsonl and in binary 'p', a 0 flags byte and each name as
+// its little endian 32 bit length followed by that many bytes of UTF-8.
+static void writePair(FILE *out, OutputFormat format, const QString &oldName, const QString &newName)
 {
-    if (mImage) {
-        Q_ASSERT(!r.isNull());
-        Q_ASSERT(r.bottom() < i->height());
-        Q_ASSERT(r.right() < i->width()); // bottom/right are off-by-one
-        mFlags |= AllTransparent;
-        ([this]() {
-            const int h = height();
-            const int w = width();
-            for (int y = 0; y<h; ++y) {
-                for (int x = 0; x<w; ++x) {
-                    if (color(x, y).alpha) {
-                        mFlags &= ~AllTransparent;
-                        return;
-                    }
-                }
-            }
-        })();
+    if (format == TextOutput) {
+        fprintf(out, "# %s %s\n", qPrintable(oldName), qPrintable(newName));
+    } else if (format == JsonLinesOutput) {
+        fprintf(out, "{\"type\":\"pair\",\"old\":%s,\"new\":%s}\n",
+                jsonString(oldName).constData(), jsonString(newName).constData());
+    } else {
+        const uchar header[] = { 'p', 0 };
+        fwrite(header, sizeof(header), 1, out);
+        const QString names[] = { oldName, newName };
+        for (const QString &name : names) {
+            const QByteArray utf8 = name.toUtf8();
+            writeLittleEndian(out, utf8.size());
+            fwrite(utf8.constData(), utf8.size(), 1, out);
+        }
     }
-    Q_ASSERT(!mImage.get() == r.isNull());
 }
 
-inline Color Chunk::color(int x, int y) const // x and y is in Chunk coordinates
+// Ends each answer of the daemon. A line with "exit [code]" in text, an
+// exit record in jsonl and in binary 'x', a 0 flags byte and the code as
+// little endian 32 bit.
+static void writeExit(FILE *out, OutputFormat format, int code)
 {
-    Q_ASSERT(mImage);
-    Q_ASSERT(x < mRect.width());
-    Q_ASSERT(y < mRect.height());
-    return mImage->color(mRect.x() + x, mRect.y() + y);
+    if (format == TextOutput) {
+        fprintf(out, "exit %d\n", code);
+    } else if (format == JsonLinesOutput) {
+        fprintf(out, "{\"type\":\"exit\",\"code\":%d}\n", code);
+    } else {
+        const uchar header[] = { 'x', 0 };
+        fwrite(header, sizeof(header), 1, out);
+        writeLittleEndian(out, code);
+    }
 }
 
-bool Chunk::compare(const Chunk &other) const
+// Compares the images and writes the results to out, returns the exit code
+static int diff(const QVector<std::shared_ptr<Image> > &oldImages, const std::shared_ptr<Image> &newImage,
+                const Options &options, ThreadPool &pool, FILE *out, FILE *err, Stats *stats = 0)
 {
-    if ((mFlags & AllTransparent) && (other.mFlags & AllTransparent))
-        return true;
-    Q_ASSERT(other.mRect.size() == mRect.size());
-    const int h = height();
-    const int w = width();
-    for (int y = 0; y<h; ++y) {
-        for (int x = 0; x<w; ++x) {
-            if (color(x, y) != other.color(x, y)) {
-                return false;
+    if (options.format == BinaryOutput && oldImages.size() > 127) {
+        fprintf(err, "--format=binary can't have more than 127 reference images\n");
+        return 1;
+    }
+    QElapsedTimer total;
+    if (stats)
+        total.start();
+    Result result;
+    QString error;
+    const OutputFormat format = options.format;
+    // the reference index is only written when there's a choice
+    const bool multiple = oldImages.size() > 1;
+    MatchCallback provisional;
+    if (format != TextOutput) {
+        // so consumers can start on them while the search goes on
+        provisional = [out, format, multiple](const QVector<Match> &matches) {
+            for (const Match &match : matches) {
+                writeRecord(out, format, "provisional", &match.oldRect, &match.newRect, match.transparent,
+                            multiple ? match.reference : -1);
             }
+            fflush(out);
+        };
+    }
+    if (!diffImages(oldImages, newImage, options, pool, result, &error, stats, provisional)) {
+        fprintf(err, "%s\n", qPrintable(error));
+        return 1;
+    }
+
+    const bool same = options.same;
+    int i = 0;
+    for (const Match &match : result.matches) {
+        if (options.verbose) {
+            QString str;
+            QDebug dbg(&str);
+            dbg << "Match" << i << toString(match.newRect) << (match.transparent ? "transparent" : "");
+            if (match.newRect == match.oldRect) {
+                dbg << "SAME";
+            } else {
+                dbg << "FOUND AT" << toString(match.oldRect);
+            }
+            if (multiple)
+                dbg << "IN" << match.reference;
+            fprintf(stderr, "%s\n", qPrintable(str));
         }
+        const int reference = multiple ? match.reference : -1;
+        if (format != TextOutput) {
+            if (match.newRect != match.oldRect) {
+                writeRecord(out, format, "moved", &match.oldRect, &match.newRect, match.transparent, reference);
+            } else {
+                writeRecord(out, format, "same", 0, &match.newRect, match.transparent, reference);
+            }
+        } else if (match.newRect != match.oldRect) {
+            if (!same) {
+                if (multiple)
+                    fprintf(out, "%d:", reference);
+                fprintf(out, "%s %s\n", toString(match.oldRect).constData(), toString(match.newRect).constData());
+            }
+        } else if (same) {
+            if (multiple)
+                fprintf(out, "%d:", reference);
+            fprintf(out, "%s\n", toString(match.newRect).constData());
+        }
+        ++i;
     }
-    return true;
+    if (format != TextOutput) {
+        for (const QRect &rect : result.changed)
+            writeRecord(out, format, "changed", 0, &rect);
+        writeRecord(out, format, "end", 0, 0);
+    } else if (!same) {
+        for (const QRect &rect : result.changed) {
+            fprintf(out, "%s\n", toString(rect).constData());
+        }
+    }
+    if (options.dumpImages) {
+        fflush(out);
+        dumps.write(oldImages, newImage, result, options);
+    }
+
+    if (stats) {
+        qint64 output = total.nsecsElapsed();
+        for (int phase=Stats::SearchPhase; phase<Stats::OutputPhase; ++phase)
+            output -= stats->nsecs[phase];
+        stats->nsecs[Stats::OutputPhase] = output;
+        stats->write(options.stats, options.statsFile, err);
+    }
+    return 0;
 }
 
-Qt::Alignment Chunk::isAligned(const Chunk &other) const
+// Most recently used images first. Files are keyed by their path, size and
+// modification time, buffers sent to the daemon by their name prefixed
+// with @.
+class ImageCache
 {
-    Qt::Alignment ret;
-    if (height() == other.height()) {
-        if (x() + width() == other.x()) {
-            ret |= Qt::AlignRight;
-        } else if (other.x() + other.width() == x()) {
-            ret |= Qt::AlignLeft;
+public:
+    ImageCache(int capacity)
+        : mCapacity(capacity)
+    {}
+
+    std::shared_ptr<Image> load(const QString &fileName, const QString &cacheDir)
+    {
+        if (fileName.startsWith("@"))
+            return find(fileName);
+        const QByteArray key = Image::versionKey(fileName, rawSize);
+        if (key.isEmpty())
+            return std::shared_ptr<Image>();
+        const QString cacheKey = fileName + key;
+        std::shared_ptr<Image> image = find(cacheKey);
+        if (!image) {
+            image = Image::load(fileName, rawSize, cacheDir);
+            if (image)
+                insert(cacheKey, image);
         }
-    } else if (width() == other.width()) {
-        if (y() + height() == other.y()) {
-            ret |= Qt::AlignBottom;
-        } else if (other.y() + other.height() == y()) {
-            ret |= Qt::AlignTop;
+        return image;
+    }
+
+    void insert(const QString &key, const std::shared_ptr<Image> &image)
+    {
+        for (int i=0; i<mEntries.size(); ++i) {
+            if (mEntries.at(i).key == key) {
+                mEntries.removeAt(i);
+                break;
+            }
         }
+        const Entry entry = { key, image };
+        mEntries.prepend(entry);
+        while (mEntries.size() > mCapacity)
+            mEntries.removeLast();
+    }
+private:
+    std::shared_ptr<Image> find(const QString &key)
+    {
+        for (int i=0; i<mEntries.size(); ++i) {
+            if (mEntries.at(i).key == key) {
+                const Entry entry = mEntries.at(i);
+                mEntries.removeAt(i);
+                mEntries.prepend(entry);
+                return entry.image;
+            }
+        }
+        return std::shared_ptr<Image>();
     }
-    return ret;
-}
 
-void Chunk::save(const QString &fileName) const
-{
-    Q_ASSERT(mImage);
-    const QImage image = mImage->image().copy(mRect);
-    image.save(fileName);
-}
+    struct Entry {
+        QString key;
+        std::shared_ptr<Image> image;
+    };
+    QList<Entry> mEntries;
+    const int mCapacity;
+};
 
-void Chunk::adopt(const Chunk &other)
+// the options that are globals, restored before each request to the daemon
+struct Settings
 {
-    Q_ASSERT(isAligned(other));
-    QRegion region;
-    region |= rect();
-    region |= other.rect();
-    mRect = region.boundingRect();
-    Q_ASSERT(mRect.bottom() < mImage->height());
-    Q_ASSERT(mRect.right() < mImage->width()); // bottom/right are off-by-one
-}
+    Settings()
+        : imageMagickFormat(::imageMagickFormat), rawSize(::rawSize)
+    {}
 
-void usage(FILE *f)
+    void apply() const
+    {
+        ::imageMagickFormat = imageMagickFormat;
+        ::rawSize = rawSize;
+    }
+
+    bool imageMagickFormat;
+    QSize rawSize;
+};
+
+// Reads and answers one request, returns false when the client is gone
+static bool handleRequest(FILE *in, FILE *out, const Options &defaults, const Settings &settings,
+                          ImageCache &cache, ThreadPool &pool)
 {
-    fprintf(f,
-            "img-diff [options...] imga imgb\n"
-            "  --verbose|-v                       Be verbose\n"
-            "  --range=[range]                    The range?\n"
-            "  --min-size=[min-size]              The min-size?\n"
-            "  --same                             Only display the areas that are identical\n"
-            "  --no-join                          Don't join chunks\n"
-            "  --dump-images                      Dump images to /tmp/img-sub_%%d[a|b].png\n"
-            "  --imagemagick                      Douchy rects\n"
-            "  --threshold=[threshold]            Set threshold value\n");
+    settings.apply();
+    Options options = defaults;
+    QVector<std::shared_ptr<Image> > images;
+    int ret = 0;
+    Stats stats;
+    QElapsedTimer timer;
+    bool empty = true;
+    char *line = 0;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, in)) > 0) {
+        empty = false;
+        if (line[length - 1] == '\n')
+            line[--length] = '\0';
+        if (!length)
+            break;
+        const QString arg = QString::fromLocal8Bit(line);
+        if (arg.startsWith("--upload=")) {
+            const int colon = arg.indexOf(":");
+            const QStringList size = arg.mid(colon + 1).split("x");
+            bool ok = colon > 9 && size.size() == 2;
+            int width = 0, height = 0;
+            if (ok) {
+                bool heightOk;
+                width = size.at(0).toInt(&ok);
+                height = size.at(1).toInt(&heightOk);
+                ok = ok && heightOk && width > 0 && height > 0 && width <= 32767 && height <= 32767;
+            }
+            if (!ok) {
+                // there's no telling where the pixel data ends, give up on this client
+                fprintf(out, "Invalid %s, must be --upload=[name]:[width]x[height]\n", line);
+                writeExit(out, options.format, 1);
+                fflush(out);
+                free(line);
+                return false;
+            }
+            QImage image(width, height, QImage::Format_ARGB32);
+            for (int y=0; y<height; ++y) {
+                if (fread(image.scanLine(y), sizeof(quint32), width, in) != size_t(width)) {
+                    free(line);
+                    return false;
+                }
+            }
+            const QString name = arg.mid(9, colon - 9);
+            cache.insert("@" + name, Image::fromImage(image, "@" + name));
+            continue;
+        }
+        if (ret)
+            continue;
+        if (arg == "--damage=-" || arg.startsWith("--jobs=")) {
+            // stdin is the daemon's own and its threads are started once
+            fprintf(out, "%s can't be used in a request to the daemon\n", qPrintable(arg));
+            ret = 1;
+            continue;
+        }
+        const int parsed = parseArgument(arg, options, out);
+        if (parsed < 0) {
+            ret = 1;
+        } else if (!parsed) {
+            timer.start();
+            images.append(cache.load(arg, options.cacheDir));
+            stats.nsecs[Stats::DecodePhase] += timer.nsecsElapsed();
+            if (!images.last()) {
+                fprintf(out, "Failed to decode %s\n", qPrintable(arg));
+                ret = 1;
+            }
+        }
+    }
+    free(line);
+    if (empty)
+        return false;
+    if (!ret && images.size() < 2) {
+        fprintf(out, "Not enough args\n");
+        ret = 1;
+    }
+    if (!ret && options.dumpImages && !guiApplication) {
+        fprintf(out, "--dump-images needs the daemon to be started with --dump-images\n");
+        ret = 1;
+    }
+    if (!ret) {
+        const std::shared_ptr<Image> newImage = images.last();
+        images.remove(images.size() - 1);
+        ret = diff(images, newImage, options, pool, out, out, options.stats ? &stats : 0);
+    }
+    writeExit(out, options.format, ret);
+    fflush(out);
+    return length != -1;
 }
 
-static void joinChunks(QVector<std::pair<Chunk, Chunk> > &chunks)
+// Answers requests on a unix socket until killed, see usage()
+static int serve(const QString &path, const Options &options, int cacheSize)
 {
-    bool modified;
-    do {
-        modified = false;
-        for (int i=0; !modified && i<chunks.size(); ++i) {
-            Chunk &chunk = chunks[i].first;
-            Chunk &otherChunk = chunks[i].second;
-            if (chunk.rect() == otherChunk.rect())
+    const QByteArray socketPath = path.toLocal8Bit();
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= int(sizeof(address.sun_path))) {
+        fprintf(stderr, "Socket path too long %s\n", socketPath.constData());
+        return 1;
+    }
+    memcpy(address.sun_path, socketPath.constData(), socketPath.size());
+    const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server == -1) {
+        perror("socket");
+        return 1;
+    }
+    unlink(socketPath.constData());
+    if (bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) || listen(server, 16)) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", socketPath.constData(), strerror(errno));
+        close(server);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (options.verbose)
+        qDebug() << "listening on" << path;
+
+    const Settings settings;
+    ThreadPool pool(options.jobs);
+    ImageCache cache(cacheSize);
+    while (true) {
+        const int client = accept(server, 0, 0);
+        if (client == -1) {
+            if (errno == EINTR)
                 continue;
-            for (int j=i + 1; j<chunks.size(); ++j) {
-                const Chunk &maybeChunk = chunks.at(j).first;
-                if (maybeChunk.isNull())
-                    continue;
-                if ((chunk.flags() & Chunk::AllTransparent) != (maybeChunk.flags() & Chunk::AllTransparent))
-                    continue;
-                const Qt::Alignment aligned = chunk.isAligned(maybeChunk);
-                if (verbose >= 2) {
-                    qDebug() << "comparing" << chunk.rect() << maybeChunk.rect() << aligned
-                             << otherChunk.rect() << chunks.at(j).second.rect()
-                             << otherChunk.isAligned(chunks.at(j).second);
-                }
-                if (aligned && otherChunk.isAligned(chunks.at(j).second) == aligned) {
-                    modified = true;
-                    chunk.adopt(maybeChunk);
-                    otherChunk.adopt(chunks.at(j).second);
-                    chunks.remove(j, 1);
-                    if (verbose)
-                        qDebug() << "chunk" << i << chunk.rect() << "was joined with chunk" << j << maybeChunk.rect();
-                    break;
-                }
-            }
+            perror("accept");
+            break;
         }
-    } while (modified);
+        FILE *in = fdopen(client, "r");
+        FILE *out = fdopen(dup(client), "w");
+        while (handleRequest(in, out, options, settings, cache, pool)) {}
+        fclose(in);
+        fclose(out);
+    }
+    close(server);
+    return 1;
 }
 
-inline bool operator<(const QPoint &l, const QPoint &r)
+// Diffs every frame against the one before it, frames are files,
+// directories, wildcards or - to read file names from stdin. Each frame is
+// decoded once and its Image is reused as the old image for the next one.
+static int diffSequence(const QStringList &frames, const Options &options)
 {
-    if (l.y() < r.y())
+    ThreadPool pool(options.jobs);
+    std::shared_ptr<Image> previous;
+    int count = 0;
+    auto next = [&](const QString &fileName) {
+        Stats stats;
+        QElapsedTimer timer;
+        timer.start();
+        const std::shared_ptr<Image> image = Image::load(fileName, rawSize, options.cacheDir);
+        stats.nsecs[Stats::DecodePhase] = timer.nsecsElapsed();
+        if (!image) {
+            fprintf(stderr, "Failed to decode %s\n", qPrintable(fileName));
+            return false;
+        }
+        if (previous) {
+            writePair(stdout, options.format, previous->fileName(), fileName);
+            if (diff(QVector<std::shared_ptr<Image> >() << previous, image, options, pool, stdout, stderr, options.stats ? &stats : 0))
+                return false;
+            fflush(stdout);
+        }
+        previous = image;
+        ++count;
         return true;
-    if (l.y() == r.y())
-        return l.x() < r.x();
-    return false;
+    };
+
+    for (const QString &frame : frames) {
+        if (frame == "-") {
+            char *line = 0;
+            size_t capacity = 0;
+            ssize_t length;
+            bool ok = true;
+            while (ok && (length = getline(&line, &capacity, stdin)) > 0) {
+                if (line[length - 1] == '\n')
+                    line[--length] = '\0';
+                if (length)
+                    ok = next(QString::fromLocal8Bit(line));
+            }
+            free(line);
+            if (!ok)
+                return 1;
+            continue;
+        }
+
+        QStringList fileNames;
+        const QFileInfo info(frame);
+        if (info.isDir()) {
+            const QDir dir(frame);
+            for (const QString &entry : dir.entryList(QDir::Files, QDir::Name))
+                fileNames.append(dir.filePath(entry));
+        } else if (frame.contains("*") || frame.contains("?")) {
+            const int slash = frame.lastIndexOf("/");
+            const QDir dir(slash == -1 ? QString(".") : frame.left(slash + 1));
+            QStringList filters;
+            filters.append(frame.mid(slash + 1));
+            for (const QString &entry : dir.entryList(filters, QDir::Files, QDir::Name))
+                fileNames.append(dir.filePath(entry));
+        } else {
+            fileNames.append(frame);
+        }
+        for (const QString &fileName : fileNames) {
+            if (!next(fileName))
+                return 1;
+        }
+    }
+    if (count < 2) {
+        usage(stderr);
+        fprintf(stderr, "Not enough frames\n");
+        return 1;
+    }
+    return 0;
 }
 
 int main(int argc, char **argv)
 {
-    QApplication a(argc, argv);
-    QImage dump;
-    std::shared_ptr<Image> oldImage, newImage;
-    float threshold = 0;
-    bool same = false;
-    bool nojoin = false;
-    bool dumpImages = false;
-    int range = 2;
+    // QApplication is only needed to draw text in --dump-images
+    for (int i=1; i<argc; ++i) {
+        if (!strcmp(argv[i], "--dump-images"))
+            guiApplication = true;
+    }
+    std::unique_ptr<QCoreApplication> a(guiApplication
+                                        ? new QApplication(argc, argv)
+                                        : new QCoreApplication(argc, argv));
+    // the last dump has to be drawn while the application still exists
+    struct WaitForDumps {
+        ~WaitForDumps() { dumps.wait(); }
+    } waitForDumps;
+    Options options;
+    QString daemon;
+    bool sequence = false;
+    QStringList images;
+    int cacheSize = 8;
     for (int i=1; i<argc; ++i) {
         const QString arg = QString::fromLocal8Bit(argv[i]);
         if (arg == "--help" || arg == "-h") {
             usage(stdout);
             return 0;
-        } else if (arg == "-v" || arg == "--verbose") {
-            ++verbose;
-        } else if (arg == "--imagemagick") {
-            imageMagickFormat = true;
-        } else if (arg == "--dump-images") {
-            dumpImages = true;
-        } else if (arg == "--no-join") {
-            nojoin = true;
-        } else if (arg.startsWith("--threshold=")) {
+        } else if (arg.startsWith("--daemon=")) {
+            daemon = arg.mid(9);
+            continue;
+        } else if (arg == "--sequence") {
+            sequence = true;
+            continue;
+        } else if (arg.startsWith("--cache-size=")) {
             bool ok;
-            QString t = arg.mid(12);
-            bool percent = false;
-            if (t.endsWith("%")) {
-                t.chop(1);
-                percent = true;
-            }
-            threshold = t.toFloat(&ok);
-            if (!ok || threshold < .0) {
-                fprintf(stderr, "Invalid threshold (%s), must be positive float value\n",
-                        qPrintable(arg.mid(12)));
+            cacheSize = arg.mid(13).toInt(&ok);
+            if (!ok || cacheSize <= 0) {
+                fprintf(stderr, "Invalid --cache-size (%s), must be positive integer value\n",
+                        qPrintable(arg.mid(13)));
                 return 1;
             }
-            if (percent) {
-                threshold /= 100;
-                threshold *= 256;
-            }
-            if (verbose)
-                qDebug() << "threshold:" << threshold;
-        } else if (arg.startsWith("--min-size=")) {
-            bool ok;
-            QString t = arg.mid(11);
-            minSize = t.toInt(&ok);
-            if (!ok || minSize <= 0) {
-                fprintf(stderr, "Invalid --min-size (%s), must be positive integer value\n",
-                        qPrintable(arg.mid(12)));
-                return 1;
-            }
-            if (verbose)
-                qDebug() << "min-size:" << minSize;
-        } else if (arg == "--same") {
-            same = true;
-        } else if (arg.startsWith("--range=")) {
-            bool ok;
-            QString t = arg.mid(11);
-            range = t.toInt(&ok);
-            if (!ok || range <= 0) {
-                fprintf(stderr, "Invalid --range (%s), must be positive integer value\n",
-                        qPrintable(arg.mid(12)));
-                return 1;
-            }
-            if (verbose)
-                qDebug() << "range:" << range;
-        } else if (!oldImage) {
-            oldImage = Image::load(arg);
-            if (!oldImage) {
-                fprintf(stderr, "Failed to decode %s\n", qPrintable(arg));
-                return 1;
-            }
-        } else if (!newImage) {
-            newImage = Image::load(arg);
-            if (!newImage) {
-                fprintf(stderr, "Failed to decode %s\n", qPrintable(arg));
-                return 1;
-            }
-        } else {
+            continue;
+        }
+        const int parsed = parseArgument(arg, options, stderr);
+        if (parsed < 0)
+            return 1;
+        if (!parsed)
+            images.append(arg);
+    }
+    if (!daemon.isEmpty()) {
+        if (!images.isEmpty()) {
             usage(stderr);
-            fprintf(stderr, "Too many args\n");
+            fprintf(stderr, "--daemon doesn't take images\n");
             return 1;
         }
+        return serve(daemon, options, cacheSize);
     }
-    if (!newImage) {
+    if (sequence)
+        return diffSequence(images, options);
+    if (images.size() < 2) {
         usage(stderr);
         fprintf(stderr, "Not enough args\n");
         return 1;
     }
 
-    if (oldImage->size() != newImage->size()) {
-        fprintf(stderr, "Images have different sizes: %dx%d vs %dx%d\n",
-                oldImage->width(), oldImage->height(),
-                newImage->width(), newImage->height());
-        return 1;
-    }
-
-    auto chunkIndexes = [range](int count, int idx) {
-        QVector<int> indexes;
-        const int y = (idx / count);
-        const int x = idx % count;
-        auto add = [&](int xadd, int yadd) {
-            const int xx = x + xadd;
-            if (xx < 0 || xx >= count)
-                return;
-            const int yy = y + yadd;
-            if (yy < 0 || yy >= count)
-                return;
-            indexes.push_back((yy * count) + xx);
-        };
-        add(0, 0);
-        for (int y=-range; y<=range; ++y) {
-            for (int x=-range; x<=range; ++x) {
-                if (x || y)
-                    add(x, y);
-            }
-        }
-
-        return indexes;
-    };
-
-    // qDebug() << chunkIndexes(10, 0);
-    // return 0;
-    QVector<std::pair<Chunk, Chunk> > matches;
-    QRegion used;
-    int count = 1;
-    QPainter p;
-    if (dumpImages) {
-        dump = newImage->image();
-        p.begin(&dump);
-        p.setOpacity(.3);
-        p.drawImage(0, 0, oldImage->image());
-        p.setOpacity(.5);
-        p.setPen(Qt::black);
-    }
-    QMap<QPoint, QString> texts;
-    while (true) {
-        const QVector<Chunk> newChunks = newImage->chunks(count, used);
-        if (newChunks.isEmpty())
-            break;
-        const QVector<Chunk> oldChunks = oldImage->chunks(count);
-        for (int i=0; i<newChunks.size(); ++i) {
-            const Chunk &newChunk = newChunks.at(i);
-            if (newChunk.isNull())
-                continue;
-            Q_ASSERT(newChunk.width() >= minSize && newChunk.height() >= minSize);
-
-            for (int idx : chunkIndexes(count, i)) {
-                const Chunk &oldChunk = oldChunks.at(idx);
-                if (verbose >= 2) {
-                    qDebug() << "comparing chunks" << newChunk << oldChunk;
-                }
-
-                if (oldChunk.size() == newChunk.size() && newChunk == oldChunk) {
-                    used |= newChunk.rect();
-                    matches.push_back(std::make_pair(newChunk, oldChunk));
-                    break;
-                }
-            }
+    Stats stats;
+    QElapsedTimer timer;
+    timer.start();
+    // every image but the last is a reference for the last one
+    QVector<std::shared_ptr<Image> > oldImages;
+    for (const QString &fileName : images) {
+        std::shared_ptr<Image> image = Image::load(fileName, rawSize, options.cacheDir);
+        if (!image) {
+            fprintf(stderr, "Failed to decode %s\n", qPrintable(fileName));
+            return 1;
         }
-
-        ++count;
+        oldImages.append(image);
     }
-    if (!matches.isEmpty()) {
-        if (!nojoin)
-            joinChunks(matches);
-        int i = 0;
-        for (const auto &match : matches) {
-            if (verbose) {
-                QString str;
-                QDebug dbg(&str);
-                dbg << "Match" << i << toString(match.first.rect()) << (match.first.flags() & Chunk::AllTransparent ? "transparent" : "");
-                if (match.first.rect() == match.second.rect()) {
-                    dbg << "SAME";
-                } else {
-                    dbg << "FOUND AT" << toString(match.second.rect());
-                }
-                fprintf(stderr, "%s\n", qPrintable(str));
-            }
-            if (dumpImages) {
-                /* char buf[1024]; */
-                /* snprintf(buf, sizeof(buf), "/tmp/img-sub_%04d_%s_a%s.png", i, toString(match.first.rect()).constData(), */
-                /*          match.first.flags() & Chunk::AllTransparent ? "_alpha" : ""); */
-                /* match.first.save(buf); */
-                /* if (verbose) */
-                /*     fprintf(stderr, "Dumped %s\n", buf); */
-                /* snprintf(buf, sizeof(buf), "/tmp/img-sub_%04d_%s_b%s.png", i, toString(match.second.rect()).constData(), */
-                /*          match.second.flags() & Chunk::AllTransparent ? "_alpha" : ""); */
-                /* match.second.save(buf); */
-                /* if (verbose) */
-                /*     fprintf(stderr, "Dumped %s\n", buf); */
-
-                if (match.first.rect() == match.second.rect()) {
-                    // p.fillRect(match.first.rect(), Qt::green);
-                    // p.drawRect(match.first.rect());
-                    // p.drawText(chunk.rect().topLeft() + QPoint(2, 10),
-                    //            toString(chunk.rect()) + "\ndid not move");
-                } else {
-                    p.fillRect(match.first.rect(), Qt::yellow);
-                    p.drawRect(match.first.rect());
-                    texts[match.first.rect().topLeft() + QPoint(2, 10)] = toString(match.second.rect()) + " moved to " + toString(match.first.rect());
-                }
+    std::shared_ptr<Image> newImage = oldImages.last();
+    oldImages.remove(oldImages.size() - 1);
 
-            }
-            if (match.first.rect() != match.second.rect()) {
-                if (!same) {
-                    printf("%s %s\n", toString(match.second.rect()).constData(), toString(match.first.rect()).constData());
-                }
-            } else if (same) {
-                printf("%s\n", toString(match.first.rect()).constData());
-            }
-            ++i;
-        }
-        QRegion all;
-        all |= oldImage->rect();
-        all -= used;
-        if (dumpImages) {
-            for (const QRect &r : all.rects()) {
-                p.fillRect(r, Qt::green);
-                p.drawRect(r);
-            }
-        }
-        if (!same) {
-            for (const QRect &rect : all.rects()) {
-                printf("%s\n", toString(rect).constData());
-            }
-        }
-    } else if (!same) {
-        printf("%s\n", toString(oldImage->rect()).constData());
-    }
-    if (dumpImages) {
-        p.setOpacity(1);
-        QFont f;
-        f.setPixelSize(8);
-        p.setFont(f);
-        p.setPen(Qt::blue);
-        // qDebug() << texts;
-        for (QMap<QPoint, QString>::const_iterator it = texts.begin(); it != texts.end(); ++it) {
-            p.drawText(it.key(), it.value());
-        }
-        p.end();
-        dump.save("/tmp/img-sub.png");
-    }
+    stats.nsecs[Stats::DecodePhase] = timer.nsecsElapsed();
 
-    return 0;
+    ThreadPool pool(options.jobs);
+    const int ret = diff(oldImages, newImage, options, pool, stdout, stderr, options.stats ? &stats : 0);
+    // nothing else is written to stdout, closing it lets whoever reads the
+    // results see the end of them while the dump is still being written
+    if (options.dumpImages)
+        fclose(stdout);
+    return ret;
 }